@@ -0,0 +1,111 @@
+// Compares the buffer pool against plain malloc and free, on the kind of
+// churn the VM puts them through: lots of small, short-lived buffers, with
+// some set of them alive at any one time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pool.h"
+
+#define OPERATIONS (10 * 1000 * 1000)
+
+// Roughly what the VM asks for - string characters, upvalue arrays and the
+// entries of small tables.
+static const size_t sizes[] = {8, 12, 16, 24, 32, 48, 64, 128, 192, 256};
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+typedef struct {
+  void *pointer;
+  size_t size;
+} Buffer;
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// Picks the sizes and slots up front, so both allocators see exactly the
+// same sequence and the random number generator stays out of the timing.
+static void generate(size_t *plan, int *slots, int live) {
+  uint32_t state = 2463534242u;
+  for (int i = 0; i < OPERATIONS; i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    plan[i] = sizes[state % SIZE_COUNT];
+    slots[i] = (int)((state >> 8) % (uint32_t)live);
+  }
+}
+
+static double runMalloc(Buffer *buffers, int live, size_t *plan, int *slots) {
+  double start = now();
+  for (int i = 0; i < OPERATIONS; i++) {
+    Buffer *buffer = &buffers[slots[i]];
+    free(buffer->pointer);
+    buffer->pointer = malloc(plan[i]);
+    buffer->size = plan[i];
+    memset(buffer->pointer, i, 8);
+  }
+  double elapsed = now() - start;
+
+  for (int i = 0; i < live; i++) {
+    free(buffers[i].pointer);
+    buffers[i].pointer = NULL;
+  }
+  return elapsed;
+}
+
+static double runPool(Buffer *buffers, int live, size_t *plan, int *slots) {
+  BufferPool pool;
+  initPool(&pool);
+
+  double start = now();
+  for (int i = 0; i < OPERATIONS; i++) {
+    Buffer *buffer = &buffers[slots[i]];
+    if (buffer->pointer != NULL) {
+      poolFree(&pool, buffer->pointer, buffer->size);
+    }
+    buffer->pointer = poolAllocate(&pool, plan[i]);
+    buffer->size = plan[i];
+    memset(buffer->pointer, i, 8);
+  }
+  double elapsed = now() - start;
+
+  for (int i = 0; i < live; i++) {
+    buffers[i].pointer = NULL;
+  }
+  freePool(&pool);
+  return elapsed;
+}
+
+int main() {
+  static const int liveCounts[] = {16, 1024, 65536};
+
+  size_t *plan = malloc(sizeof(size_t) * OPERATIONS);
+  int *slots = malloc(sizeof(int) * OPERATIONS);
+  if (plan == NULL || slots == NULL)
+    return 1;
+
+  printf("%10s %14s %14s %8s\n", "live", "malloc ns/op", "pool ns/op",
+         "speedup");
+  for (size_t i = 0; i < sizeof(liveCounts) / sizeof(liveCounts[0]); i++) {
+    int live = liveCounts[i];
+    Buffer *buffers = calloc(live, sizeof(Buffer));
+    if (buffers == NULL)
+      return 1;
+    generate(plan, slots, live);
+
+    double mallocTime = runMalloc(buffers, live, plan, slots);
+    double poolTime = runPool(buffers, live, plan, slots);
+    printf("%10d %14.2f %14.2f %7.2fx\n", live, mallocTime * 1e9 / OPERATIONS,
+           poolTime * 1e9 / OPERATIONS, mallocTime / poolTime);
+    free(buffers);
+  }
+
+  free(plan);
+  free(slots);
+  return 0;
+}
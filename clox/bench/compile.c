@@ -0,0 +1,83 @@
+// Measures how fast the compiler gets through source code, in megabytes per
+// second. The script is the kind a program would generate: lots of functions
+// that all lean on the same handful of globals, with a good many locals each.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "vm.h"
+
+#define SOURCE_SIZE (4 * 1024 * 1024)
+#define RUNS 5
+
+typedef struct {
+  char *chars;
+  size_t length;
+  size_t capacity;
+} Buffer;
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void append(Buffer *buffer, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer->chars + buffer->length,
+                         buffer->capacity - buffer->length, format, args);
+  va_end(args);
+  buffer->length += length;
+}
+
+static void generate(Buffer *buffer) {
+  append(buffer, "var total = 0;\nvar name = \"\";\n");
+  append(buffer, "fun emit(key, value) { total = total + value; }\n");
+
+  for (int i = 0; buffer->length < SOURCE_SIZE - 4096; i++) {
+    append(buffer, "fun record%d(base) {\n", i);
+    for (int j = 0; j < 24; j++) {
+      append(buffer, "  var field%d = base * %d + %d.5;\n", j, j + 1, i % 100);
+    }
+    for (int j = 0; j < 24; j++) {
+      append(buffer, "  emit(\"field%d\", field%d);\n", j, j);
+      append(buffer, "  if (field%d > total) { total = total + 1; }\n", j);
+    }
+    append(buffer, "  name = \"record%d\";\n  return total;\n}\n", i);
+  }
+}
+
+int main() {
+  Buffer source;
+  source.capacity = SOURCE_SIZE;
+  source.length = 0;
+  source.chars = malloc(source.capacity);
+  if (source.chars == NULL)
+    return 1;
+  generate(&source);
+
+  initVM();
+  double best = 0;
+  for (int i = 0; i < RUNS; i++) {
+    double start = now();
+    ObjFunction *function = compile(source.chars);
+    double elapsed = now() - start;
+    if (function == NULL)
+      return 1;
+    if (best == 0 || elapsed < best)
+      best = elapsed;
+  }
+  freeVM();
+
+  double megabytes = (double)source.length / (1024 * 1024);
+  printf("%.2f MB of source, best of %d: %.1f ms, %.2f MB/s\n", megabytes,
+         RUNS, best * 1e3, megabytes / best);
+
+  free(source.chars);
+  return 0;
+}
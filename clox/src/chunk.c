@@ -8,13 +8,15 @@ void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
@@ -25,11 +27,24 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code =
         GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  // Still on the same line, so the current run covers this byte too.
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity,
+                              chunk->lineCapacity);
+  }
+  LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = chunk->count - 1;
+  lineStart->line = line;
 }
 
 int addConstant(Chunk *chunk, Value value) {
@@ -41,3 +56,29 @@ int addConstant(Chunk *chunk, Value value) {
   pop();
   return chunk->constants.count - 1;
 }
+
+// Takes back everything written since the chunk was the given size, for the
+// compiler to replace with something better.
+void truncateChunk(Chunk *chunk, int count) {
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+// Only needed for errors and the disassembler, so a binary search over the
+// runs is plenty fast.
+int getLine(Chunk *chunk, int offset) {
+  int start = 0;
+  int end = chunk->lineCount - 1;
+  while (start < end) {
+    int mid = start + (end - start + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      start = mid;
+    } else {
+      end = mid - 1;
+    }
+  }
+  return chunk->lines[start].line;
+}
@@ -6,6 +6,11 @@
 
 typedef enum {
   OP_CONSTANT,
+  // Loads a constant past the first 256, with a three-byte index.
+  OP_CONSTANT_LONG,
+  // Pushes a small integer, carried in a signed byte instead of the
+  // constant pool.
+  OP_SMALL_INT,
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
@@ -20,6 +25,11 @@ typedef enum {
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
   OP_GET_SUPER,
+  // Pops as many values as its operand says into a new list, and pushes it.
+  OP_BUILD_LIST,
+  // list[index], and list[index] = value, which leaves the value behind.
+  OP_INDEX_GET,
+  OP_INDEX_SET,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -27,13 +37,61 @@ typedef enum {
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  // The same operations with a small integer as the right operand, carried
+  // in a signed byte.
+  OP_ADD_IMM,
+  OP_SUBTRACT_IMM,
+  OP_EQUAL_IMM,
+  OP_GREATER_IMM,
+  OP_LESS_IMM,
+  // Register forms, in the style of Lua: they name the locals they work on
+  // by slot, instead of having them pushed first. The first kind takes two
+  // slots, the second a slot and a signed byte, and both push the result.
+  // Only the optimizer emits these, when asked to with --registers.
+  OP_ADD_RR,
+  OP_SUBTRACT_RR,
+  OP_MULTIPLY_RR,
+  OP_DIVIDE_RR,
+  OP_EQUAL_RR,
+  OP_GREATER_RR,
+  OP_LESS_RR,
+  OP_ADD_RI,
+  OP_SUBTRACT_RI,
+  OP_EQUAL_RI,
+  OP_GREATER_RI,
+  OP_LESS_RI,
+  // Pops a value into a local's slot.
+  OP_STORE_LOCAL,
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_LOOP,
+  // Counted loops, in the style of Lua's FORPREP and FORLOOP, for a `for`
+  // that compares a local against a limit and steps it by a small integer.
+  // Both take the local's slot, a mode byte, the limit, the step as a signed
+  // byte and a jump offset. The prep jumps forwards past the loop if the
+  // condition doesn't hold to begin with. The loop steps the local and jumps
+  // back to the body while it still does. The local is read and written in
+  // its own slot every time, so the body is free to assign or capture it.
+  OP_FOR_PREP,
+  OP_FOR_LOOP,
   OP_CALL,
+  // Calls to math natives, which the compiler emits in place of loading the
+  // global and calling it, with just the arguments on the stack. They run
+  // inline, until the program assigns to the global or passes something
+  // other than a number, when they call whatever the global holds instead.
+  // In the same order as the intrinsics table in mathlib.h.
+  OP_ABS,
+  OP_FLOOR,
+  OP_CEIL,
+  OP_SQRT,
+  OP_SIN,
+  OP_COS,
+  OP_POW,
+  OP_MIN,
+  OP_MAX,
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
@@ -46,13 +104,38 @@ typedef enum {
   OP_PUSH_EXCEPTION_HANDLER,
   OP_POP_EXCEPTION_HANDLER,
   OP_PROPAGATE_EXCEPTION,
+  // Never in a chunk. The VM turns a decoded OP_CALL into this once it finds
+  // a native there, to call natives without going through callValue.
+  OP_CALL_NATIVE,
+  // A prefix that doubles the width of the next instruction's operands:
+  // constant indexes and slots take two bytes, jump offsets and handler
+  // addresses take four. Argument counts stay at one byte.
+  OP_WIDE,
 } OpCode;
 
+// Bits in the mode byte of OP_FOR_PREP and OP_FOR_LOOP.
+//
+// The condition was <= or >=, which compile to the opposite comparison and a
+// not, rather than < or >.
+#define FOR_INCLUSIVE 0x1
+// The limit is a local's slot, rather than the index of a number constant.
+#define FOR_LOCAL_LIMIT 0x2
+
+// Consecutive instructions nearly always come from the same line, so line
+// numbers are stored as runs: each entry covers the code from its offset up to
+// the next entry's.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
-  int *lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart *lines;
   ValueArray constants;
 } Chunk;
 
@@ -60,5 +143,7 @@ void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int getLine(Chunk *chunk, int offset);
+void truncateChunk(Chunk *chunk, int count);
 
 #endif
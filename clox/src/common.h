@@ -9,5 +9,6 @@
 // that in a .env file and in CMakeLists.txt.
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
@@ -1,11 +1,14 @@
 #include "compiler.h"
 #include "memory.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
+#include "mathlib.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -17,6 +20,10 @@ typedef struct {
   Token previous;
   bool hadError;
   bool panicMode;
+  // Set when a forward jump, handler address or catch type turned out too big
+  // for the narrow encoding. The whole program gets compiled again with wide
+  // jumps.
+  bool jumpOverflow;
 } Parser;
 
 // From lowest to highest. Depends on C assigning these numbers in order.
@@ -46,10 +53,12 @@ typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  // The local with the same name that this one shadows, or -1.
+  int shadowed;
 } Local;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 } Upvalue;
 
@@ -65,10 +74,28 @@ typedef struct Compiler {
   ObjFunction *function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  // Grown as needed, since a function can have far more locals than most
+  // ever use.
+  Local *locals;
   int localCount;
+  int localCapacity;
+  // Once a function has enough locals that scanning them gets slow, names are
+  // looked up in this table instead. It maps each name to the newest local
+  // with it, and holds indexes into `locals` - -1 for an empty slot, and
+  // TOMBSTONE for a name that's gone out of scope.
+  int *localTable;
+  int localTableCount;
+  int localTableCapacity;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  // The constants the function already has, so each number and string only
+  // takes up one slot in its pool. Holds indexes into the pool rather than
+  // the values, since the collector moves objects around.
+  int *constantTable;
+  int constantTableCount;
+  int constantTableCapacity;
+  // How many OP_INVOKEs there are, each with its own cache.
+  int callSiteCount;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -77,6 +104,16 @@ typedef struct ClassCompiler {
 } ClassCompiler;
 
 Parser parser;
+// Where the code for the left operand of the infix operator being compiled
+// starts, so it can be folded together with the right one, and how many
+// constants there were before it.
+int leftOperandStart;
+int leftConstantsStart;
+// Forward jumps have to be emitted before anyone knows how far they go. They
+// get two bytes unless an earlier attempt at compiling found that too few.
+bool wideJumps = false;
+bool optimizeCode = false;
+bool useRegisters = false;
 Compiler *current = NULL;
 ClassCompiler *currentClass = NULL;
 Chunk *compilingChunk;
@@ -146,22 +183,80 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+// Emits an operand of the given width in bytes, most significant first.
+static void emitOperand(uint32_t operand, int width) {
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+    emitByte((operand >> shift) & 0xff);
+  }
+}
+
+static void patchOperand(int offset, uint32_t operand, int width) {
+  for (int i = 0; i < width; i++) {
+    currentChunk()->code[offset + i] =
+        (operand >> ((width - 1 - i) * 8)) & 0xff;
+  }
+}
+
+// Emits an instruction with a one-byte index operand, or a two-byte one
+// behind OP_WIDE when the index doesn't fit.
+static void emitIndexed(uint8_t instruction, int index) {
+  if (index <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)index);
+  } else if (index <= UINT16_MAX) {
+    emitBytes(OP_WIDE, instruction);
+    emitOperand(index, 2);
+  } else {
+    error("Too many constants in one chunk.");
+  }
+}
+
+// Call sites past the last one that fits in two bytes all share it. It never
+// caches anything, since they don't all invoke the same method.
+#define MAX_CALL_SITES UINT16_COUNT
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX)
-    error("Loop body too large.");
+static void emitInvoke(int name, uint8_t argCount) {
+  int site = current->callSiteCount;
+  if (site < MAX_CALL_SITES) {
+    current->callSiteCount++;
+  } else {
+    site = MAX_CALL_SITES - 1;
+  }
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  if (name > UINT16_MAX) {
+    error("Too many constants in one chunk.");
+  } else if (name <= UINT8_MAX && site <= UINT8_MAX) {
+    emitBytes(OP_INVOKE, (uint8_t)name);
+    emitBytes(argCount, (uint8_t)site);
+  } else {
+    emitBytes(OP_WIDE, OP_INVOKE);
+    emitOperand(name, 2);
+    emitByte(argCount);
+    emitOperand(site, 2);
+  }
+}
+
+static void emitLoop(int loopStart) {
+  // Loops jump backwards, so they know how far they go and only the long ones
+  // need OP_WIDE.
+  int offset = currentChunk()->count + 3 - loopStart;
+  if (offset <= UINT16_MAX) {
+    emitByte(OP_LOOP);
+    emitOperand(offset, 2);
+  } else {
+    emitBytes(OP_WIDE, OP_LOOP);
+    emitOperand(offset + 3, 4);
+  }
 }
 
 static int emitJump(uint8_t instruction) {
+  if (wideJumps) {
+    emitBytes(OP_WIDE, instruction);
+    emitOperand(UINT32_MAX, 4);
+    return currentChunk()->count - 4;
+  }
   emitByte(instruction);
   // Jump offset is 16 bits, not 8
-  emitByte(0xff);
-  emitByte(0xff);
+  emitOperand(UINT16_MAX, 2);
   return currentChunk()->count - 2;
 }
 
@@ -178,45 +273,263 @@ static void emitReturn() {
   emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+// The most constants OP_CONSTANT_LONG can reach.
+#define MAX_CONSTANTS (1 << 24)
+
+// The compiler's hash tables are open-addressed arrays of indexes, kept no
+// more than three-quarters full.
+#define TABLE_MAX_LOAD 0.75
+
+static int *newIndexTable(int capacity) {
+  int *table = (int *)malloc(sizeof(int) * capacity);
+  if (table == NULL)
+    exit(1);
+  for (int i = 0; i < capacity; i++) {
+    table[i] = -1;
+  }
+  return table;
+}
+
+static uint32_t hashConstant(Value value) {
+  if (IS_STRING(value))
+    return AS_STRING(value)->hash;
+
+  // Hash the bits, so 0 and -0 end up as different constants.
+  double number = AS_NUMBER(value);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static bool sameConstant(Value a, Value b) {
+  if (IS_STRING(a) || IS_STRING(b)) {
+    // Strings are interned.
+    return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+  }
+  if (!IS_NUMBER(b))
+    return false;
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+// Returns the slot in the constant table where the value is, or where it
+// would go.
+static int *findConstant(Value value) {
+  Compiler *compiler = current;
+  ValueArray *constants = &currentChunk()->constants;
+  if (compiler->constantTableCount + 1 >
+      compiler->constantTableCapacity * TABLE_MAX_LOAD) {
+    int *old = compiler->constantTable;
+    int oldCapacity = compiler->constantTableCapacity;
+    compiler->constantTableCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->constantTable = newIndexTable(compiler->constantTableCapacity);
+    compiler->constantTableCount = 0;
+    for (int i = 0; i < oldCapacity; i++) {
+      if (old[i] == -1)
+        continue;
+      int *slot = findConstant(constants->values[old[i]]);
+      *slot = old[i];
+      compiler->constantTableCount++;
+    }
+    free(old);
+  }
+
+  uint32_t mask = compiler->constantTableCapacity - 1;
+  uint32_t index = hashConstant(value) & mask;
+  for (;;) {
+    int *slot = &compiler->constantTable[index];
+    if (*slot == -1 || sameConstant(constants->values[*slot], value))
+      return slot;
+    index = (index + 1) & mask;
+  }
+}
+
+static int makeConstant(Value value) {
+  // Generated code tends to repeat the same names and numbers over and over,
+  // so only the first of each gets added.
+  bool shared = IS_NUMBER(value) || IS_STRING(value);
+  if (shared) {
+    int *slot = findConstant(value);
+    if (*slot != -1)
+      return *slot;
+  }
+
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  writeBarrier((Obj *)current->function, value);
+  if (constant >= MAX_CONSTANTS) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  if (shared) {
+    *findConstant(value) = constant;
+    current->constantTableCount++;
+  }
+  return constant;
+}
+
+// Takes the constants from the given index on back out of the pool. They have
+// to be ones nothing else uses, like those of operands that got folded away.
+static void dropConstants(int count) {
+  Compiler *compiler = current;
+  ValueArray *constants = &currentChunk()->constants;
+  for (int constant = constants->count - 1; constant >= count; constant--) {
+    Value value = constants->values[constant];
+    if (!IS_NUMBER(value) && !IS_STRING(value))
+      continue;
+    int *slot = findConstant(value);
+    if (*slot != constant)
+      continue;
+
+    // There are no tombstones, so every entry after the hole that could have
+    // been in it gets shifted back into it
+    uint32_t mask = compiler->constantTableCapacity - 1;
+    uint32_t hole = slot - compiler->constantTable;
+    uint32_t index = hole;
+    for (;;) {
+      index = (index + 1) & mask;
+      int entry = compiler->constantTable[index];
+      if (entry == -1)
+        break;
+      uint32_t home = hashConstant(constants->values[entry]) & mask;
+      if (((index - home) & mask) >= ((index - hole) & mask)) {
+        compiler->constantTable[hole] = entry;
+        hole = index;
+      }
+    }
+    compiler->constantTable[hole] = -1;
+    compiler->constantTableCount--;
+  }
+
+  if (count < constants->count) {
+    __atomic_store_n(&constants->count, count, __ATOMIC_RELEASE);
+  }
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int constant = makeConstant(value);
+  if (constant <= UINT8_MAX) {
+    emitBytes(OP_CONSTANT, (uint8_t)constant);
+  } else {
+    emitByte(OP_CONSTANT_LONG);
+    emitOperand(constant, 3);
+  }
+}
+
+// Whether a number fits in OP_SMALL_INT's signed byte. Negative zero doesn't,
+// since the byte can't tell it apart from zero.
+static bool isSmallInt(double value) {
+  return value >= INT8_MIN && value <= INT8_MAX && value == (int)value &&
+         !(value == 0 && signbit(value));
+}
+
+// Emits whichever instruction loads the value most cheaply.
+static void emitValue(Value value) {
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else if (IS_NUMBER(value) && isSmallInt(AS_NUMBER(value))) {
+    emitBytes(OP_SMALL_INT, (uint8_t)(int8_t)AS_NUMBER(value));
+  } else {
+    emitConstant(value);
+  }
+}
+
+// If the code from start to end is nothing but a single constant being
+// loaded, returns true and gives its value. That's how the compiler tells
+// which operands it can work out ahead of time.
+static bool constantOperand(int start, int end, Value *value) {
+  Chunk *chunk = currentChunk();
+  int length = end - start;
+  if (length <= 0)
+    return false;
+
+  uint8_t *code = &chunk->code[start];
+  switch (code[0]) {
+  case OP_NIL:
+    *value = NIL_VAL;
+    return length == 1;
+  case OP_TRUE:
+    *value = BOOL_VAL(true);
+    return length == 1;
+  case OP_FALSE:
+    *value = BOOL_VAL(false);
+    return length == 1;
+  case OP_SMALL_INT:
+    *value = NUMBER_VAL((int8_t)code[1]);
+    return length == 2;
+  case OP_CONSTANT:
+    *value = chunk->constants.values[code[1]];
+    return length == 2;
+  case OP_CONSTANT_LONG:
+    *value = chunk->constants.values[code[1] << 16 | code[2] << 8 | code[3]];
+    return length == 4;
+  default:
+    return false;
+  }
 }
 
 static void patchJump(int offset) {
-  // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+  int width = wideJumps ? 4 : 2;
+  // Adjust for the bytecode for the jump offset itself.
+  int jump = currentChunk()->count - offset - width;
 
-  if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+  if (!wideJumps && jump > UINT16_MAX) {
+    parser.jumpOverflow = true;
+    return;
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  patchOperand(offset, jump, width);
 }
 
-// Takes the 16 bit address stored at the current offset and patches it
-// back to the passed-in offset.
+// Takes the address stored at the current offset and patches it back to the
+// passed-in offset. 0xffff is the placeholder for a missing address, so a
+// narrow one has to stay below it.
 static void patchAddress(int offset) {
-  currentChunk()->code[offset] = (currentChunk()->count >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = currentChunk()->count & 0xff;
+  int address = currentChunk()->count;
+  if (!wideJumps && address >= UINT16_MAX) {
+    parser.jumpOverflow = true;
+    return;
+  }
+
+  patchOperand(offset, address, wideJumps ? 4 : 2);
 }
 
+// These are declared ahead of time because there are circular calls.
+static void expression();
+static void statement();
+static void declaration();
+static ParseRule *getRule(TokenType type);
+static void parsePrecedence(Precedence precedence);
+
+// These are declared because my functions got out-of-order compared to what
+// they should've been, and it was easier than trying to debug it.
+static int identifierConstant(Token *name);
+static int resolveLocal(Compiler *compiler, Token *name);
+static int resolveUpvalue(Compiler *compiler, Token *name);
+static void addLocal(Token name);
+static Token syntheticToken(const char *text);
+
 static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->localTable = NULL;
+  compiler->localTableCount = 0;
+  compiler->localTableCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->constantTable = NULL;
+  compiler->constantTableCount = 0;
+  compiler->constantTableCapacity = 0;
+  compiler->callSiteCount = 0;
   // Note, we create the function at compile time, even though it's a
   // runtime object. Think of it like a string or number literal.
   //
@@ -227,40 +540,95 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   if (type != TYPE_SCRIPT) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
+    writeBarrier((Obj *)current->function,
+                 OBJ_VAL(current->function->name));
   }
 
   // Stack slot zero is "for the compiler's internal use." It has an empty
   // identifier so nobody can reach for it.
-  Local *local = &current->locals[current->localCount++];
-  local->depth = 0;
-  local->isCaptured = false;
-  if (type != TYPE_FUNCTION) {
-    local->name.start = "this";
-    local->name.length = 4;
-  } else {
-    local->name.start = "";
-    local->name.length = 0;
+  addLocal(syntheticToken(type != TYPE_FUNCTION ? "this" : ""));
+  current->locals[0].depth = 0;
+}
+
+// Works out whether the function is simple enough to be run without a frame
+// of its own, going by the code it starts with.
+static void findInlineKind(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  uint8_t *code = chunk->code;
+  Value value;
+  int length;
+  switch (code[0]) {
+  case OP_GET_LOCAL:
+    if (code[2] == OP_RETURN) {
+      function->inlineKind = INLINE_ARGUMENT;
+      function->inlineOperand = code[1];
+    } else if (code[1] == 0 && code[2] == OP_GET_PROPERTY &&
+               code[4] == OP_RETURN) {
+      function->inlineKind = INLINE_FIELD;
+      function->inlineOperand = code[3];
+    }
+    return;
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    length = 1;
+    break;
+  case OP_SMALL_INT:
+  case OP_CONSTANT:
+    length = 2;
+    break;
+  case OP_CONSTANT_LONG:
+    length = 4;
+    break;
+  default:
+    return;
+  }
+
+  if (code[length] == OP_RETURN && constantOperand(0, length, &value)) {
+    function->inlineKind = INLINE_CONSTANT;
+    function->inlineOperand = makeConstant(value);
   }
 }
 
 static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+  if (!parser.hadError && !parser.jumpOverflow) {
+    if (optimizeCode || useRegisters)
+      optimizeChunk(currentChunk(), useRegisters);
+    if (current->type != TYPE_SCRIPT)
+      findInlineKind(function);
+  }
+  function->callSites = ALLOCATE(CallSite, current->callSiteCount);
+  for (int i = 0; i < current->callSiteCount; i++) {
+    function->callSites[i].cls = NULL;
+    function->callSites[i].method = NULL;
+    function->callSites[i].misses = 0;
+  }
+  function->callSiteCount = current->callSiteCount;
+  if (function->callSiteCount == MAX_CALL_SITES) {
+    function->callSites[MAX_CALL_SITES - 1].misses = MAX_SITE_MISSES;
+  }
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (!parser.hadError && !parser.jumpOverflow) {
     disassembleChunk(currentChunk(), function->name != NULL
                                          ? function->name->chars
                                          : "<script>");
   }
 #endif
 
+  free(current->locals);
+  free(current->localTable);
+  free(current->constantTable);
   current = current->enclosing;
   return function;
 }
 
 static void beginScope() { current->scopeDepth++; }
 
+static void removeLocal(Compiler *compiler, int local);
+
 static void endScope() {
   current->scopeDepth--;
 
@@ -275,52 +643,146 @@ static void endScope() {
     } else {
       emitByte(OP_POP);
     }
+    removeLocal(current, current->localCount - 1);
     current->localCount--;
   }
 }
 
-// These are declared ahead of time because there are circular calls.
-static void expression();
-static void statement();
-static void declaration();
-static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+// A peephole for binary operators. If their right operand compiled to nothing
+// but an OP_SMALL_INT, it's taken back out and carried in the operator's
+// immediate form instead.
+static bool emitImmediate(uint8_t instruction, int operandStart) {
+  Chunk *chunk = currentChunk();
+  if (chunk->count != operandStart + 2 ||
+      chunk->code[operandStart] != OP_SMALL_INT) {
+    return false;
+  }
 
-// These are declared because my functions got out-of-order compared to what
-// they should've been, and it was easier than trying to debug it.
-static uint8_t identifierConstant(Token *name);
-static int resolveLocal(Compiler *compiler, Token *name);
-static int resolveUpvalue(Compiler *compiler, Token *name);
+  uint8_t immediate = chunk->code[operandStart + 1];
+  truncateChunk(chunk, operandStart);
+  emitBytes(instruction, immediate);
+  return true;
+}
+
+// Works out a binary operator on two constants, the way the VM would. Returns
+// false for anything that would be a runtime error, so the error still
+// happens when the code runs.
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value *result) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+    case TOKEN_PLUS:
+      *result = NUMBER_VAL(x + y);
+      return true;
+    case TOKEN_MINUS:
+      *result = NUMBER_VAL(x - y);
+      return true;
+    case TOKEN_STAR:
+      *result = NUMBER_VAL(x * y);
+      return true;
+    case TOKEN_SLASH:
+      *result = NUMBER_VAL(x / y);
+      return true;
+    // These compile to the opposite comparison and a not, which only makes a
+    // difference for NaN
+    case TOKEN_GREATER:
+      *result = BOOL_VAL(x > y);
+      return true;
+    case TOKEN_GREATER_EQUAL:
+      *result = BOOL_VAL(!(x < y));
+      return true;
+    case TOKEN_LESS:
+      *result = BOOL_VAL(x < y);
+      return true;
+    case TOKEN_LESS_EQUAL:
+      *result = BOOL_VAL(!(x > y));
+      return true;
+    default:
+      break;
+    }
+  }
+
+  switch (operatorType) {
+  case TOKEN_EQUAL_EQUAL:
+    *result = BOOL_VAL(valuesEqual(a, b));
+    return true;
+  case TOKEN_BANG_EQUAL:
+    *result = BOOL_VAL(!valuesEqual(a, b));
+    return true;
+  case TOKEN_PLUS: {
+    if (!IS_STRING(a) || !IS_STRING(b))
+      return false;
+    ObjString *left = AS_STRING(a);
+    ObjString *right = AS_STRING(b);
+    int length = left->length + right->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    chars[length] = '\0';
+    *result = OBJ_VAL(takeString(chars, length));
+    return true;
+  }
+  default:
+    return false;
+  }
+}
 
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
+  int leftStart = leftOperandStart;
+  int leftConstants = leftConstantsStart;
+  int operandStart = currentChunk()->count;
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  // With both operands known, their loads are replaced by the result
+  Value a, b, result;
+  if (constantOperand(leftStart, operandStart, &a) &&
+      constantOperand(operandStart, currentChunk()->count, &b) &&
+      foldBinary(operatorType, a, b, &result)) {
+    truncateChunk(currentChunk(), leftStart);
+    dropConstants(leftConstants);
+    emitValue(result);
+    return;
+  }
+
   switch (operatorType) {
   case TOKEN_BANG_EQUAL:
-    emitBytes(OP_EQUAL, OP_NOT);
+    if (!emitImmediate(OP_EQUAL_IMM, operandStart))
+      emitByte(OP_EQUAL);
+    emitByte(OP_NOT);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emitByte(OP_EQUAL);
+    if (!emitImmediate(OP_EQUAL_IMM, operandStart))
+      emitByte(OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    emitByte(OP_GREATER);
+    if (!emitImmediate(OP_GREATER_IMM, operandStart))
+      emitByte(OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitBytes(OP_LESS, OP_NOT);
+    if (!emitImmediate(OP_LESS_IMM, operandStart))
+      emitByte(OP_LESS);
+    emitByte(OP_NOT);
     break;
   case TOKEN_LESS:
-    emitByte(OP_LESS);
+    if (!emitImmediate(OP_LESS_IMM, operandStart))
+      emitByte(OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    emitBytes(OP_GREATER, OP_NOT);
+    if (!emitImmediate(OP_GREATER_IMM, operandStart))
+      emitByte(OP_GREATER);
+    emitByte(OP_NOT);
     break;
   case TOKEN_PLUS:
-    emitByte(OP_ADD);
+    if (!emitImmediate(OP_ADD_IMM, operandStart))
+      emitByte(OP_ADD);
     break;
   case TOKEN_MINUS:
-    emitByte(OP_SUBTRACT);
+    if (!emitImmediate(OP_SUBTRACT_IMM, operandStart))
+      emitByte(OP_SUBTRACT);
     break;
   case TOKEN_STAR:
     emitByte(OP_MULTIPLY);
@@ -355,20 +817,46 @@ static void call(bool canAssign) {
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitIndexed(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
-    emitByte(argCount);
+    emitInvoke(name, argCount);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitIndexed(OP_GET_PROPERTY, name);
   }
 }
 
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_INDEX_SET);
+  } else {
+    emitByte(OP_INDEX_GET);
+  }
+}
+
+static void list(bool canAssign) {
+  uint8_t itemCount = 0;
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression();
+      if (itemCount == 255) {
+        error("Can't have more than 255 items in a list literal.");
+      }
+      itemCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+  emitBytes(OP_BUILD_LIST, itemCount);
+}
+
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
   case TOKEN_FALSE:
@@ -392,7 +880,7 @@ static void grouping(bool canAssign) {
 
 static void number(bool canAssign) {
   double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  emitValue(NUMBER_VAL(value));
 }
 
 static void and_(bool canAssign) {
@@ -434,6 +922,56 @@ static void string(bool canAssign) {
       copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+// Moves the code from `from` to the end back to `offset`, ahead of the code
+// that was in between. Every byte keeps the line it was emitted on.
+static void hoistCode(int offset, int from) {
+  Chunk *chunk = currentChunk();
+  int length = chunk->count - offset;
+  uint8_t *code = malloc(length);
+  int *lines = malloc(sizeof(int) * length);
+  if (code == NULL || lines == NULL)
+    exit(1);
+  for (int i = 0; i < length; i++) {
+    code[i] = chunk->code[offset + i];
+    lines[i] = getLine(chunk, offset + i);
+  }
+
+  truncateChunk(chunk, offset);
+  int split = from - offset;
+  for (int i = split; i < length; i++) {
+    writeChunk(currentChunk(), code[i], lines[i]);
+  }
+  for (int i = 0; i < split; i++) {
+    writeChunk(currentChunk(), code[i], lines[i]);
+  }
+  free(code);
+  free(lines);
+}
+
+// Compiles a call to a global named after one of the math intrinsics, and
+// returns whether there was one. With the right number of arguments, the
+// call is the intrinsic's instruction, with no callee to load. With any
+// other number it's an ordinary call, so the global it skipped goes back in
+// ahead of the arguments.
+static bool intrinsicCall(Token *name) {
+  int instruction = findIntrinsic(name->start, name->length);
+  if (instruction == -1 || !match(TOKEN_LEFT_PAREN))
+    return false;
+
+  int argumentsStart = currentChunk()->count;
+  uint8_t argCount = argumentList();
+  if (argCount == intrinsics[instruction - OP_ABS].arity) {
+    emitByte((uint8_t)instruction);
+    return true;
+  }
+
+  int callee = currentChunk()->count;
+  emitIndexed(OP_GET_GLOBAL, identifierConstant(name));
+  hoistCode(argumentsStart, callee);
+  emitBytes(OP_CALL, argCount);
+  return true;
+}
+
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
   int arg = resolveLocal(current, &name);
@@ -446,6 +984,8 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
+    if (intrinsicCall(&name))
+      return;
     arg = identifierConstant(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
@@ -453,9 +993,9 @@ static void namedVariable(Token name, bool canAssign) {
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitIndexed(setOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitIndexed(getOp, arg);
   }
 }
 
@@ -479,17 +1019,17 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitIndexed(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitIndexed(OP_GET_SUPER, name);
   }
 }
 
@@ -505,7 +1045,20 @@ static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
 
   // Compile the operand.
-  expression();
+  int operandStart = currentChunk()->count;
+  int constants = currentChunk()->constants.count;
+  parsePrecedence(PREC_UNARY);
+
+  // Fold it if it's a constant, unless negating it would be a runtime error
+  Value value;
+  if (constantOperand(operandStart, currentChunk()->count, &value) &&
+      (operatorType == TOKEN_BANG || IS_NUMBER(value))) {
+    truncateChunk(currentChunk(), operandStart);
+    dropConstants(constants);
+    emitValue(operatorType == TOKEN_BANG ? BOOL_VAL(isFalsey(value))
+                                         : NUMBER_VAL(-AS_NUMBER(value)));
+    return;
+  }
 
   // Emit the operator instruction.
   switch (operatorType) {
@@ -525,6 +1078,8 @@ ParseRule rules[] = {
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
@@ -580,12 +1135,16 @@ static void parsePrecedence(Precedence precedence) {
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
+  int start = currentChunk()->count;
+  int constants = currentChunk()->constants.count;
   prefixRule(canAssign);
 
   // Now look up infix parsers - ie, binary
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
+    leftOperandStart = start;
+    leftConstantsStart = constants;
     infixRule(canAssign);
   }
 
@@ -594,7 +1153,7 @@ static void parsePrecedence(Precedence precedence) {
   }
 }
 
-static uint8_t identifierConstant(Token *name) {
+static int identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
@@ -604,21 +1163,104 @@ static bool identifiersEqual(Token *a, Token *b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler *compiler, Token *name) {
-  for (int i = compiler->localCount - 1; i >= 0; i--) {
-    Local *local = &compiler->locals[i];
-    if (identifiersEqual(name, &local->name)) {
-      if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
-      }
-      return i;
+// Past this many locals, a function's names go in a hash table instead of
+// being found by scanning backwards through all of them.
+#define LOCAL_TABLE_THRESHOLD 16
+
+#define TOMBSTONE -2
+
+static uint32_t hashName(Token *name) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < name->length; i++) {
+    hash ^= (uint8_t)name->start[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// Returns the slot in the local table holding the newest local with the
+// name, or the one it would go in.
+static int *findLocalSlot(Compiler *compiler, Token *name) {
+  uint32_t mask = compiler->localTableCapacity - 1;
+  uint32_t index = hashName(name) & mask;
+  int *tombstone = NULL;
+  for (;;) {
+    int *slot = &compiler->localTable[index];
+    if (*slot == -1)
+      return tombstone != NULL ? tombstone : slot;
+    if (*slot == TOMBSTONE) {
+      if (tombstone == NULL)
+        tombstone = slot;
+    } else if (identifiersEqual(name, &compiler->locals[*slot].name)) {
+      return slot;
     }
+    index = (index + 1) & mask;
+  }
+}
+
+static void insertLocal(Compiler *compiler, int local) {
+  if (compiler->localTableCount + 1 >
+      compiler->localTableCapacity * TABLE_MAX_LOAD) {
+    int *old = compiler->localTable;
+    int oldCapacity = compiler->localTableCapacity;
+    compiler->localTableCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->localTable = newIndexTable(compiler->localTableCapacity);
+    compiler->localTableCount = 0;
+    // Only the newest local with each name is in there. The ones it shadows
+    // stay chained behind it.
+    for (int i = 0; i < oldCapacity; i++) {
+      if (old[i] < 0)
+        continue;
+      *findLocalSlot(compiler, &compiler->locals[old[i]].name) = old[i];
+      compiler->localTableCount++;
+    }
+    free(old);
+  }
+
+  int *slot = findLocalSlot(compiler, &compiler->locals[local].name);
+  if (*slot >= 0) {
+    compiler->locals[local].shadowed = *slot;
+  } else {
+    if (*slot == -1)
+      compiler->localTableCount++;
+    compiler->locals[local].shadowed = -1;
+  }
+  *slot = local;
+}
+
+// Takes the local back out of the table as it goes out of scope, bringing
+// back whichever one it was shadowing.
+static void removeLocal(Compiler *compiler, int local) {
+  if (compiler->localTable == NULL)
+    return;
+  int *slot = findLocalSlot(compiler, &compiler->locals[local].name);
+  int shadowed = compiler->locals[local].shadowed;
+  *slot = shadowed != -1 ? shadowed : TOMBSTONE;
+}
+
+// Finds the newest local with the name, or returns -1.
+static int findLocal(Compiler *compiler, Token *name) {
+  if (compiler->localTable != NULL) {
+    int local = *findLocalSlot(compiler, name);
+    return local >= 0 ? local : -1;
   }
 
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    if (identifiersEqual(name, &compiler->locals[i].name))
+      return i;
+  }
   return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int resolveLocal(Compiler *compiler, Token *name) {
+  int local = findLocal(compiler, name);
+  if (local != -1 && compiler->locals[local].depth == -1) {
+    error("Can't read local variable in its own initializer.");
+  }
+  return local;
+}
+
+static int addUpvalue(Compiler *compiler, uint16_t index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
   // If an upvalue already exists for that index, just use that
@@ -649,40 +1291,60 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     // We're capturing the local into an upvalue
     compiler->enclosing->locals[local].isCaptured = true;
     // now we can create an upvalue and return it
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, (uint16_t)local, true);
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
-  if (upvalue != 1) {
-    return addUpvalue(compiler, (uint8_t)local, false);
+  if (upvalue != -1) {
+    return addUpvalue(compiler, (uint16_t)upvalue, false);
   }
 
   return -1;
 }
 
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
+  // The compiler's own memory stays out of the collector's heap. Compacting
+  // the buffer pool only knows to move the buffers that objects point to.
+  if (current->localCapacity < current->localCount + 1) {
+    current->localCapacity = GROW_CAPACITY(current->localCapacity);
+    current->locals = (Local *)realloc(
+        current->locals, sizeof(Local) * current->localCapacity);
+    if (current->locals == NULL)
+      exit(1);
+  }
   Local *local = &current->locals[current->localCount++];
   local->name = name;
   local->depth = -1; // indicates declared but not initialized
   local->isCaptured = false;
+  local->shadowed = -1;
+  if (current->localCount > current->function->slotCount) {
+    current->function->slotCount = current->localCount;
+  }
+
+  if (current->localTable != NULL) {
+    insertLocal(current, current->localCount - 1);
+  } else if (current->localCount == LOCAL_TABLE_THRESHOLD) {
+    for (int i = 0; i < current->localCount; i++) {
+      insertLocal(current, i);
+    }
+  }
 }
 
 static void declareVariable() {
   if (current->scopeDepth == 0)
     return;
 
+  // Locals are ordered by depth, so only the newest one with the name can be
+  // in this scope.
   Token *name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local *local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
-      break;
-    }
-
-    if (identifiersEqual(name, &local->name)) {
+  int existing = findLocal(current, name);
+  if (existing != -1) {
+    Local *local = &current->locals[existing];
+    if (local->depth == -1 || local->depth >= current->scopeDepth) {
       error("Already a variable with this name in this scope.");
     }
   }
@@ -690,7 +1352,7 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static int parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
@@ -706,12 +1368,12 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
@@ -719,8 +1381,17 @@ static ParseRule *getRule(TokenType type) { return &rules[type]; }
 static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
 
 static void block() {
+  // Nothing after a return in the same block can run. It's still compiled,
+  // so its errors get reported, but the code is dropped.
+  bool returned = false;
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    int start = currentChunk()->count;
+    bool isReturn = check(TOKEN_RETURN);
     declaration();
+    if (returned) {
+      truncateChunk(currentChunk(), start);
+    }
+    returned = returned || isReturn;
   }
 
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
@@ -738,7 +1409,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -749,18 +1420,33 @@ static void function(FunctionType type) {
   // don't need to close scope bc we're ending the compiler anyway
   ObjFunction *function = endCompiler();
   // function def is constant, just like other literals
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  int constant = makeConstant(OBJ_VAL(function));
+
+  // The wide form widens the captured slots along with the constant
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    wide = wide || compiler.upvalues[i].index > UINT8_MAX;
+  }
+  if (wide && constant > UINT16_MAX) {
+    error("Too many constants in one chunk.");
+  }
+  if (wide) {
+    emitBytes(OP_WIDE, OP_CLOSURE);
+    emitOperand(constant, 2);
+  } else {
+    emitBytes(OP_CLOSURE, (uint8_t)constant);
+  }
 
   // OP_CLOSURE takes a variable number of bytes, two for each upvalue
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    emitOperand(compiler.upvalues[i].index, wide ? 2 : 1);
   }
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  int constant = identifierConstant(&parser.previous);
 
   FunctionType type = TYPE_METHOD;
   if (parser.previous.length == 4 &&
@@ -768,16 +1454,16 @@ static void method() {
     type = TYPE_INITIALIZER;
   }
   function(type);
-  emitBytes(OP_METHOD, constant);
+  emitIndexed(OP_METHOD, constant);
 }
 
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  int nameConstant = identifierConstant(&parser.previous);
   declareVariable();
 
-  emitBytes(OP_CLASS, nameConstant);
+  emitIndexed(OP_CLASS, nameConstant);
   defineVariable(nameConstant);
 
   ClassCompiler classCompiler;
@@ -822,7 +1508,7 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   // Allow self-referential calls
   markInitialized();
   function(TYPE_FUNCTION);
@@ -830,7 +1516,7 @@ static void funDeclaration() {
 }
 
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -848,6 +1534,103 @@ static void expressionStatement() {
   emitByte(OP_POP);
 }
 
+// What OP_FOR_PREP and OP_FOR_LOOP need to know about a counted loop.
+typedef struct {
+  uint8_t slot;
+  uint8_t mode;
+  uint8_t limit;
+  int8_t step;
+} CountedLoop;
+
+// Recognizes a loop condition that compares a local against a number constant
+// or another local, like `i < n` or `i >= 0`. Returns which way the local has
+// to go for the loop to end, 1 for up and -1 for down, or 0 if it's some other
+// kind of condition.
+static int countedCondition(int start, int end, CountedLoop *loop) {
+  Chunk *chunk = currentChunk();
+  uint8_t *code = &chunk->code[start];
+  int length = end - start;
+  if (length < 4 || code[0] != OP_GET_LOCAL)
+    return 0;
+  loop->slot = code[1];
+  loop->mode = 0;
+
+  uint8_t compare;
+  int next;
+  if (code[2] == OP_LESS_IMM || code[2] == OP_GREATER_IMM) {
+    compare = code[2] == OP_LESS_IMM ? OP_LESS : OP_GREATER;
+    int constant = makeConstant(NUMBER_VAL((int8_t)code[3]));
+    if (constant > UINT8_MAX)
+      return 0;
+    loop->limit = (uint8_t)constant;
+    next = 4;
+  } else if (length >= 5 && (code[4] == OP_LESS || code[4] == OP_GREATER)) {
+    if (code[2] == OP_GET_LOCAL) {
+      loop->mode |= FOR_LOCAL_LIMIT;
+    } else if (code[2] != OP_CONSTANT ||
+               !IS_NUMBER(chunk->constants.values[code[3]])) {
+      return 0;
+    }
+    compare = code[4];
+    loop->limit = code[3];
+    next = 5;
+  } else {
+    return 0;
+  }
+
+  if (next < length && code[next] == OP_NOT) {
+    loop->mode |= FOR_INCLUSIVE;
+    next++;
+  }
+  if (next != length)
+    return 0;
+  // < and <= wait for the local to go up, > and >= for it to go down.
+  bool up = (compare == OP_LESS) != ((loop->mode & FOR_INCLUSIVE) != 0);
+  return up ? 1 : -1;
+}
+
+// Recognizes an increment that adds a small positive integer to the loop's
+// local or takes one away from it, like `i = i + 1`.
+static bool countedIncrement(int start, int end, CountedLoop *loop) {
+  uint8_t *code = &currentChunk()->code[start];
+  if (end - start != 6 || code[0] != OP_GET_LOCAL || code[1] != loop->slot ||
+      code[4] != OP_SET_LOCAL || code[5] != loop->slot) {
+    return false;
+  }
+
+  // Adding and subtracting report different errors for a local that isn't a
+  // number, so the step's sign has to say which one it was.
+  int8_t amount = (int8_t)code[3];
+  if (amount <= 0)
+    return false;
+  if (code[2] == OP_ADD_IMM) {
+    loop->step = amount;
+  } else if (code[2] == OP_SUBTRACT_IMM) {
+    loop->step = (int8_t)-amount;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Emits OP_FOR_PREP or OP_FOR_LOOP on the line of the clause it stands in for,
+// and returns where its jump operand is.
+static int emitCountedLoop(uint8_t instruction, CountedLoop *loop,
+                           uint32_t jump, int width, int line) {
+  Chunk *chunk = currentChunk();
+  if (width == 4)
+    writeChunk(chunk, OP_WIDE, line);
+  writeChunk(chunk, instruction, line);
+  writeChunk(chunk, loop->slot, line);
+  writeChunk(chunk, loop->mode, line);
+  writeChunk(chunk, loop->limit, line);
+  writeChunk(chunk, (uint8_t)loop->step, line);
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+    writeChunk(chunk, (jump >> shift) & 0xff, line);
+  }
+  return chunk->count - width;
+}
+
 static void forStatement() {
   beginScope();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
@@ -861,10 +1644,13 @@ static void forStatement() {
     expressionStatement();
   }
 
-  int loopStart = currentChunk()->count;
+  int conditionStart = currentChunk()->count;
+  int conditionEnd = -1;
+  int loopStart = conditionStart;
   int exitJump = -1;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
+    conditionEnd = currentChunk()->count;
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
     // Jump out of the loop if the condition is false.
@@ -872,12 +1658,15 @@ static void forStatement() {
     emitByte(OP_POP); // Condition.
   }
 
+  int incrementStart = -1;
+  int incrementEnd = -1;
   if (!match(TOKEN_RIGHT_PAREN)) {
     // Jump to the body immediately and don't eval the increment at the
     // beginning
     int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
+    incrementStart = currentChunk()->count;
     expression();
+    incrementEnd = currentChunk()->count;
     emitByte(OP_POP);
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
@@ -886,6 +1675,38 @@ static void forStatement() {
     patchJump(bodyJump);
   }
 
+  // A loop that counts a local up or down to a limit trades the code for its
+  // clauses in for a prep before the body and a step after it.
+  CountedLoop loop;
+  int direction = 0;
+  if (exitJump != -1 && incrementStart != -1) {
+    direction = countedCondition(conditionStart, conditionEnd, &loop);
+  }
+  if (direction != 0 && countedIncrement(incrementStart, incrementEnd, &loop) &&
+      (loop.step > 0) == (direction > 0)) {
+    Chunk *chunk = currentChunk();
+    int conditionLine = getLine(chunk, conditionStart);
+    int incrementLine = getLine(chunk, incrementStart);
+    truncateChunk(chunk, conditionStart);
+
+    int width = wideJumps ? 4 : 2;
+    exitJump =
+        emitCountedLoop(OP_FOR_PREP, &loop, UINT32_MAX, width, conditionLine);
+    int bodyStart = chunk->count;
+    statement();
+
+    // Like any other loop, it knows how far back it goes
+    int offset = currentChunk()->count + 7 - bodyStart;
+    if (offset <= UINT16_MAX) {
+      emitCountedLoop(OP_FOR_LOOP, &loop, offset, 2, incrementLine);
+    } else {
+      emitCountedLoop(OP_FOR_LOOP, &loop, offset + 3, 4, incrementLine);
+    }
+    patchJump(exitJump);
+    endScope();
+    return;
+  }
+
   statement();
   // This actually loops back to the *increment* if one is defined
   emitLoop(loopStart);
@@ -900,9 +1721,31 @@ static void forStatement() {
 
 static void ifStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  int conditionStart = currentChunk()->count;
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  // When the condition is a constant, only one branch can ever run. The
+  // other is compiled for its errors and then dropped, along with the test.
+  Value condition;
+  if (constantOperand(conditionStart, currentChunk()->count, &condition)) {
+    truncateChunk(currentChunk(), conditionStart);
+    bool taken = !isFalsey(condition);
+
+    int branchStart = currentChunk()->count;
+    statement();
+    if (!taken)
+      truncateChunk(currentChunk(), branchStart);
+
+    if (match(TOKEN_ELSE)) {
+      branchStart = currentChunk()->count;
+      statement();
+      if (taken)
+        truncateChunk(currentChunk(), branchStart);
+    }
+    return;
+  }
+
   // If false, stub jumping to the end of the if
   int thenJump = emitJump(OP_JUMP_IF_FALSE);
   // We start the truthy part by popping the conditional
@@ -974,19 +1817,24 @@ static void throwStatement() {
 
 static void tryCatchStatement() {
   // PUSH_EXC_HANDLER <type_ident_const> <handler_addr>
+  // The addresses are wide whenever jumps are, and the type comes along
+  int typeWidth = wideJumps ? 2 : 1;
+  int addressWidth = wideJumps ? 4 : 2;
+  if (wideJumps)
+    emitByte(OP_WIDE);
   emitByte(OP_PUSH_EXCEPTION_HANDLER);
   // The index of the exception type
   int exceptionType = currentChunk()->count;
   // The stand-in for the exception type
-  emitByte(0xff);
+  emitOperand(UINT32_MAX, typeWidth);
   // The index of the handler address
   int handlerAddress = currentChunk()->count;
   // The stand-in for the handler address
-  emitBytes(0xff, 0xff);
+  emitOperand(UINT32_MAX, addressWidth);
   // The index of the finally address
   int finallyAddress = currentChunk()->count;
   // The stand-in for the finally address
-  emitBytes(0xff, 0xff);
+  emitOperand(UINT32_MAX, addressWidth);
 
   // The contents of the try (probably a block, may contain a "throw")
   statement();
@@ -1022,9 +1870,15 @@ static void tryCatchStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'");
     consume(TOKEN_IDENTIFIER, "Expect type name after catch");
     // The type name is an identifier constant
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
     // patch the type of the exception
-    currentChunk()->code[exceptionType] = name;
+    if (name > UINT16_MAX) {
+      error("Too many constants in one chunk.");
+    } else if (name >= 1 << (typeWidth * 8)) {
+      parser.jumpOverflow = true;
+    } else {
+      patchOperand(exceptionType, name, typeWidth);
+    }
     // patch the address to the handler
     patchAddress(handlerAddress);
     if (match(TOKEN_AS)) {
@@ -1032,8 +1886,8 @@ static void tryCatchStatement() {
       consume(TOKEN_IDENTIFIER, "Expect identifier for exception instance");
       addLocal(parser.previous);
       markInitialized();
-      uint8_t ex_var = resolveLocal(current, &parser.previous);
-      emitBytes(OP_SET_LOCAL, ex_var);
+      int ex_var = resolveLocal(current, &parser.previous);
+      emitIndexed(OP_SET_LOCAL, ex_var);
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after catch statement");
     emitByte(OP_POP_EXCEPTION_HANDLER);
@@ -1093,6 +1947,11 @@ static void synchronize() {
 }
 
 static void declaration() {
+  // Between declarations, every object the compiler is using is reachable
+  // from its roots.
+  if (vm.gcRequested && !gcSafepoint())
+    error("Out of memory.");
+
   if (match(TOKEN_CLASS)) {
     classDeclaration();
   } else if (match(TOKEN_FUN)) {
@@ -1132,20 +1991,32 @@ static void statement() {
 }
 
 ObjFunction *compile(const char *source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+  wideJumps = false;
+  for (;;) {
+    initScanner(source);
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT);
 
-  parser.hadError = false;
-  parser.panicMode = false;
+    parser.hadError = false;
+    parser.panicMode = false;
+    parser.jumpOverflow = false;
 
-  advance();
+    advance();
 
-  while (!match(TOKEN_EOF)) {
-    declaration();
+    while (!match(TOKEN_EOF)) {
+      declaration();
+    }
+    ObjFunction *function = endCompiler();
+    if (parser.hadError)
+      return NULL;
+    if (!parser.jumpOverflow)
+      return function;
+
+    // Some jump didn't fit in two bytes. Programs that big are rare, so
+    // rather than moving code around to make room, start over and give every
+    // jump four.
+    wideJumps = true;
   }
-  ObjFunction *function = endCompiler();
-  return parser.hadError ? NULL : function;
 }
 
 void markCompilerRoots() {
@@ -1156,3 +2027,11 @@ void markCompilerRoots() {
     compiler = compiler->enclosing;
   }
 }
+
+void forwardCompilerRoots() {
+  Compiler *compiler = current;
+  while (compiler != NULL) {
+    compiler->function = (ObjFunction *)forwardObject((Obj *)compiler->function);
+    compiler = compiler->enclosing;
+  }
+}
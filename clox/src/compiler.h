@@ -4,7 +4,15 @@
 #include "object.h"
 #include "vm.h"
 
+// Whether each function goes through the optimizer once it's compiled. That
+// makes compiling slower, so it's off unless asked for.
+extern bool optimizeCode;
+// Whether the optimizer lowers operations on locals to the register forms
+// that address their slots directly. Implies optimizeCode.
+extern bool useRegisters;
+
 ObjFunction *compile(const char *source);
 void markCompilerRoots();
+void forwardCompilerRoots();
 
 #endif
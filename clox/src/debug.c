@@ -25,6 +25,27 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int immediateInstruction(const char *name, Chunk *chunk, int offset) {
+  int8_t immediate = (int8_t)chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, immediate);
+  return offset + 2;
+}
+
+static int registerInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+static int registerImmediateInstruction(const char *name, Chunk *chunk,
+                                        int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  int8_t immediate = (int8_t)chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, slot, immediate);
+  return offset + 3;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk,
                            int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -41,6 +62,17 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int constantLongInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint32_t constant = chunk->code[offset + 1] << 16;
+  constant |= chunk->code[offset + 2] << 8;
+  constant |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
@@ -50,6 +82,18 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+// OP_INVOKE also carries the index of its call site's cache.
+static int cachedInvokeInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint8_t site = chunk->code[offset + 3];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' @%d\n", site);
+  return offset + 4;
+}
+
 static int exceptionHandlerInstruction(const char *name, Chunk *chunk,
                                        int offset) {
   uint8_t type = chunk->code[offset + 1];
@@ -61,18 +105,181 @@ static int exceptionHandlerInstruction(const char *name, Chunk *chunk,
   return offset + 6;
 }
 
+// Reads an operand of the given width in bytes, most significant first.
+static uint32_t readOperand(Chunk *chunk, int offset, int width) {
+  uint32_t operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = operand << 8 | chunk->code[offset + i];
+  }
+  return operand;
+}
+
+// OP_FOR_PREP and OP_FOR_LOOP, with a jump operand of the given width. The
+// comparison shown is the one the loop's condition makes.
+static int countedLoopInstruction(const char *name, int sign, Chunk *chunk,
+                                  int offset, int width) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t mode = chunk->code[offset + 2];
+  uint8_t limit = chunk->code[offset + 3];
+  int8_t step = (int8_t)chunk->code[offset + 4];
+  uint32_t jump = readOperand(chunk, offset + 5, width);
+  int next = offset + 5 + width;
+
+  const char *compare = step > 0 ? "<" : ">";
+  if (mode & FOR_INCLUSIVE)
+    compare = step > 0 ? "<=" : ">=";
+  printf("%-16s %4d %s ", name, slot, compare);
+  if (mode & FOR_LOCAL_LIMIT) {
+    printf("slot %d", limit);
+  } else {
+    printf("'");
+    printValue(chunk->constants.values[limit]);
+    printf("'");
+  }
+  printf(" step %d -> %d\n", step, next + sign * (int)jump);
+  return next;
+}
+
+static int closureInstruction(const char *name, Chunk *chunk, int offset,
+                              int width) {
+  offset++;
+  uint16_t constant = readOperand(chunk, offset, width);
+  offset += width;
+  printf("%-16s %4d ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int j = 0; j < function->upvalueCount; j++) {
+    int isLocal = chunk->code[offset];
+    int index = readOperand(chunk, offset + 1, width);
+    printf("%04d      |                     %s %d\n", offset,
+           isLocal ? "local" : "upvalue", index);
+    offset += 1 + width;
+  }
+
+  return offset;
+}
+
+// The rest read the instruction after OP_WIDE, with its wider operands.
+static int wideByteInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = readOperand(chunk, offset + 1, 2);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+static int wideConstantInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint16_t constant = readOperand(chunk, offset + 1, 2);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int wideInvokeInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t constant = readOperand(chunk, offset + 1, 2);
+  uint8_t argCount = chunk->code[offset + 3];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int wideCachedInvokeInstruction(const char *name, Chunk *chunk,
+                                       int offset) {
+  uint16_t constant = readOperand(chunk, offset + 1, 2);
+  uint8_t argCount = chunk->code[offset + 3];
+  uint16_t site = readOperand(chunk, offset + 4, 2);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' @%d\n", site);
+  return offset + 6;
+}
+
+static int wideJumpInstruction(const char *name, int sign, Chunk *chunk,
+                               int offset) {
+  uint32_t jump = readOperand(chunk, offset + 1, 4);
+  printf("%-16s %4d -> %d\n", name, offset - 1, offset + 5 + sign * (int)jump);
+  return offset + 5;
+}
+
+static int wideExceptionHandlerInstruction(const char *name, Chunk *chunk,
+                                           int offset) {
+  uint16_t type = readOperand(chunk, offset + 1, 2);
+  uint32_t handlerAddress = readOperand(chunk, offset + 3, 4);
+  uint32_t finallyAddress = readOperand(chunk, offset + 7, 4);
+  printf("%-16s %4d -> %u, %u\n", name, type, handlerAddress, finallyAddress);
+  return offset + 11;
+}
+
+static int wideInstruction(Chunk *chunk, int offset) {
+  printf("OP_WIDE ");
+  offset++;
+  uint8_t instruction = chunk->code[offset];
+  switch (instruction) {
+  case OP_GET_LOCAL:
+    return wideByteInstruction("OP_GET_LOCAL", chunk, offset);
+  case OP_SET_LOCAL:
+    return wideByteInstruction("OP_SET_LOCAL", chunk, offset);
+  case OP_GET_GLOBAL:
+    return wideConstantInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_DEFINE_GLOBAL:
+    return wideConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_SET_GLOBAL:
+    return wideConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_GET_PROPERTY:
+    return wideConstantInstruction("OP_GET_PROPERTY", chunk, offset);
+  case OP_SET_PROPERTY:
+    return wideConstantInstruction("OP_SET_PROPERTY", chunk, offset);
+  case OP_GET_SUPER:
+    return wideConstantInstruction("OP_GET_SUPER", chunk, offset);
+  case OP_JUMP:
+    return wideJumpInstruction("OP_JUMP", 1, chunk, offset);
+  case OP_JUMP_IF_FALSE:
+    return wideJumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_LOOP:
+    return wideJumpInstruction("OP_LOOP", -1, chunk, offset);
+  case OP_FOR_PREP:
+    return countedLoopInstruction("OP_FOR_PREP", 1, chunk, offset, 4);
+  case OP_FOR_LOOP:
+    return countedLoopInstruction("OP_FOR_LOOP", -1, chunk, offset, 4);
+  case OP_INVOKE:
+    return wideCachedInvokeInstruction("OP_INVOKE", chunk, offset);
+  case OP_SUPER_INVOKE:
+    return wideInvokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_CLOSURE:
+    return closureInstruction("OP_CLOSURE", chunk, offset, 2);
+  case OP_CLASS:
+    return wideConstantInstruction("OP_CLASS", chunk, offset);
+  case OP_METHOD:
+    return wideConstantInstruction("OP_METHOD", chunk, offset);
+  case OP_PUSH_EXCEPTION_HANDLER:
+    return wideExceptionHandlerInstruction("OP_PUSH_EXCEPTION_HANDLER", chunk,
+                                           offset);
+  default:
+    printf("Unknown opcode %d\n", instruction);
+    return offset + 1;
+  }
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_SMALL_INT:
+    return immediateInstruction("OP_SMALL_INT", chunk, offset);
   case OP_NIL:
     return simpleInstruction("OP_NIL", offset);
   case OP_TRUE:
@@ -115,6 +322,42 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_MULTIPLY", offset);
   case OP_DIVIDE:
     return simpleInstruction("OP_DIVIDE", offset);
+  case OP_ADD_IMM:
+    return immediateInstruction("OP_ADD_IMM", chunk, offset);
+  case OP_SUBTRACT_IMM:
+    return immediateInstruction("OP_SUBTRACT_IMM", chunk, offset);
+  case OP_EQUAL_IMM:
+    return immediateInstruction("OP_EQUAL_IMM", chunk, offset);
+  case OP_GREATER_IMM:
+    return immediateInstruction("OP_GREATER_IMM", chunk, offset);
+  case OP_LESS_IMM:
+    return immediateInstruction("OP_LESS_IMM", chunk, offset);
+  case OP_ADD_RR:
+    return registerInstruction("OP_ADD_RR", chunk, offset);
+  case OP_SUBTRACT_RR:
+    return registerInstruction("OP_SUBTRACT_RR", chunk, offset);
+  case OP_MULTIPLY_RR:
+    return registerInstruction("OP_MULTIPLY_RR", chunk, offset);
+  case OP_DIVIDE_RR:
+    return registerInstruction("OP_DIVIDE_RR", chunk, offset);
+  case OP_EQUAL_RR:
+    return registerInstruction("OP_EQUAL_RR", chunk, offset);
+  case OP_GREATER_RR:
+    return registerInstruction("OP_GREATER_RR", chunk, offset);
+  case OP_LESS_RR:
+    return registerInstruction("OP_LESS_RR", chunk, offset);
+  case OP_ADD_RI:
+    return registerImmediateInstruction("OP_ADD_RI", chunk, offset);
+  case OP_SUBTRACT_RI:
+    return registerImmediateInstruction("OP_SUBTRACT_RI", chunk, offset);
+  case OP_EQUAL_RI:
+    return registerImmediateInstruction("OP_EQUAL_RI", chunk, offset);
+  case OP_GREATER_RI:
+    return registerImmediateInstruction("OP_GREATER_RI", chunk, offset);
+  case OP_LESS_RI:
+    return registerImmediateInstruction("OP_LESS_RI", chunk, offset);
+  case OP_STORE_LOCAL:
+    return byteInstruction("OP_STORE_LOCAL", chunk, offset);
   case OP_NOT:
     return simpleInstruction("OP_NOT", offset);
   case OP_NEGATE:
@@ -127,29 +370,42 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
   case OP_LOOP:
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
+  case OP_FOR_PREP:
+    return countedLoopInstruction("OP_FOR_PREP", 1, chunk, offset, 2);
+  case OP_FOR_LOOP:
+    return countedLoopInstruction("OP_FOR_LOOP", -1, chunk, offset, 2);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_BUILD_LIST:
+    return byteInstruction("OP_BUILD_LIST", chunk, offset);
+  case OP_INDEX_GET:
+    return simpleInstruction("OP_INDEX_GET", offset);
+  case OP_INDEX_SET:
+    return simpleInstruction("OP_INDEX_SET", offset);
+  case OP_ABS:
+    return simpleInstruction("OP_ABS", offset);
+  case OP_FLOOR:
+    return simpleInstruction("OP_FLOOR", offset);
+  case OP_CEIL:
+    return simpleInstruction("OP_CEIL", offset);
+  case OP_SQRT:
+    return simpleInstruction("OP_SQRT", offset);
+  case OP_SIN:
+    return simpleInstruction("OP_SIN", offset);
+  case OP_COS:
+    return simpleInstruction("OP_COS", offset);
+  case OP_POW:
+    return simpleInstruction("OP_POW", offset);
+  case OP_MIN:
+    return simpleInstruction("OP_MIN", offset);
+  case OP_MAX:
+    return simpleInstruction("OP_MAX", offset);
   case OP_INVOKE:
-    return invokeInstruction("OP_INVOKE", chunk, offset);
+    return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-  case OP_CLOSURE: {
-    offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
-    printValue(chunk->constants.values[constant]);
-    printf("\n");
-
-    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-    for (int j = 0; j < function->upvalueCount; j++) {
-      int isLocal = chunk->code[offset++];
-      int index = chunk->code[offset++];
-      printf("%04d      |                     %s %d\n", offset - 2,
-             isLocal ? "local" : "upvalue", index);
-    }
-
-    return offset;
-  }
+  case OP_CLOSURE:
+    return closureInstruction("OP_CLOSURE", chunk, offset, 1);
   case OP_CLOSE_UPVALUE:
     return simpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_RETURN:
@@ -166,10 +422,11 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return exceptionHandlerInstruction("OP_PUSH_EXCEPTION_HANDLER", chunk,
                                        offset);
   case OP_POP_EXCEPTION_HANDLER:
-    return exceptionHandlerInstruction("OP_POP_EXCEPTION_HANDLER", chunk,
-                                       offset);
+    return simpleInstruction("OP_POP_EXCEPTION_HANDLER", offset);
   case OP_PROPAGATE_EXCEPTION:
     return simpleInstruction("OP_PROPAGATE_EXCEPTION", offset);
+  case OP_WIDE:
+    return wideInstruction(chunk, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
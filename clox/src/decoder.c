@@ -0,0 +1,234 @@
+#include "decoder.h"
+
+#include <stdlib.h>
+
+#include "memory.h"
+
+// Stands in for a finally address that was never filled in.
+#define NO_TARGET -1
+
+// Reads an operand of the given width in bytes, most significant first.
+static uint32_t readOperand(Chunk *chunk, int offset, int width) {
+  uint32_t operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = operand << 8 | chunk->code[offset + i];
+  }
+  return operand;
+}
+
+// Instructions whose only operand is an index into the constant pool.
+static bool isNamed(uint8_t op) {
+  switch (op) {
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_CLASS:
+  case OP_METHOD:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Decodes the instruction at offset into op, and returns the offset of the
+// next one. Returns the opcode it decodes to in opcode, and the byte offset it
+// jumps to in target, or -1 if it doesn't. Exception handlers are left holding
+// byte offsets too. The caller turns them all into instructions once it knows
+// where they all are.
+static int decodeInstruction(Chunk *chunk, int offset, DecodedOp *op,
+                             uint8_t *opcode, int *target) {
+  Value *constants = chunk->constants.values;
+  op->value = NIL_VAL;
+  op->target = NULL;
+  op->a = 0;
+  op->b = 0;
+  op->c = 0;
+  op->flags = 0;
+  op->offset = (uint32_t)offset;
+  *target = -1;
+
+  int width = 1;
+  if (chunk->code[offset] == OP_WIDE) {
+    width = 2;
+    offset++;
+  }
+  uint8_t instruction = chunk->code[offset++];
+  *opcode = instruction;
+  switch (instruction) {
+  case OP_CONSTANT:
+    op->value = constants[chunk->code[offset++]];
+    break;
+  case OP_CONSTANT_LONG:
+    *opcode = OP_CONSTANT;
+    op->value = constants[readOperand(chunk, offset, 3)];
+    offset += 3;
+    break;
+  case OP_SMALL_INT:
+    *opcode = OP_CONSTANT;
+    op->value = NUMBER_VAL((int8_t)chunk->code[offset++]);
+    break;
+  case OP_NIL:
+    *opcode = OP_CONSTANT;
+    break;
+  case OP_TRUE:
+  case OP_FALSE:
+    *opcode = OP_CONSTANT;
+    op->value = BOOL_VAL(instruction == OP_TRUE);
+    break;
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+    op->a = (int32_t)readOperand(chunk, offset, width);
+    offset += width;
+    break;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_BUILD_LIST:
+  case OP_STORE_LOCAL:
+    op->a = chunk->code[offset++];
+    break;
+  case OP_ADD_IMM:
+  case OP_SUBTRACT_IMM:
+  case OP_EQUAL_IMM:
+  case OP_GREATER_IMM:
+  case OP_LESS_IMM:
+    op->a = (int8_t)chunk->code[offset++];
+    break;
+  case OP_ADD_RR:
+  case OP_SUBTRACT_RR:
+  case OP_MULTIPLY_RR:
+  case OP_DIVIDE_RR:
+  case OP_EQUAL_RR:
+  case OP_GREATER_RR:
+  case OP_LESS_RR:
+    op->a = chunk->code[offset];
+    op->b = chunk->code[offset + 1];
+    offset += 2;
+    break;
+  case OP_ADD_RI:
+  case OP_SUBTRACT_RI:
+  case OP_EQUAL_RI:
+  case OP_GREATER_RI:
+  case OP_LESS_RI:
+    op->a = chunk->code[offset];
+    op->b = (int8_t)chunk->code[offset + 1];
+    offset += 2;
+    break;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+    offset += width * 2;
+    *target = offset + (int)readOperand(chunk, offset - width * 2, width * 2);
+    break;
+  case OP_LOOP:
+    // Once the target is resolved, a backward jump is just a jump.
+    *opcode = OP_JUMP;
+    offset += width * 2;
+    *target = offset - (int)readOperand(chunk, offset - width * 2, width * 2);
+    break;
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP: {
+    op->a = chunk->code[offset];
+    op->flags = chunk->code[offset + 1];
+    uint8_t limit = chunk->code[offset + 2];
+    if (op->flags & FOR_LOCAL_LIMIT) {
+      op->c = limit;
+    } else {
+      op->value = constants[limit];
+    }
+    op->b = (int8_t)chunk->code[offset + 3];
+    offset += 4 + width * 2;
+    uint32_t jump = readOperand(chunk, offset - width * 2, width * 2);
+    *target = instruction == OP_FOR_PREP ? offset + (int)jump
+                                         : offset - (int)jump;
+    break;
+  }
+  case OP_INVOKE:
+    op->value = constants[readOperand(chunk, offset, width)];
+    op->a = chunk->code[offset + width];
+    op->b = (int32_t)readOperand(chunk, offset + width + 1, width);
+    offset += width * 2 + 1;
+    break;
+  case OP_SUPER_INVOKE:
+    op->value = constants[readOperand(chunk, offset, width)];
+    op->a = chunk->code[offset + width];
+    offset += width + 1;
+    break;
+  case OP_CLOSURE: {
+    // The captured variables stay in the chunk, and run() reads them from
+    // there.
+    op->value = constants[readOperand(chunk, offset, width)];
+    offset += width;
+    op->a = width;
+    op->b = offset;
+    offset += AS_FUNCTION(op->value)->upvalueCount * (1 + width);
+    break;
+  }
+  case OP_PUSH_EXCEPTION_HANDLER: {
+    op->value = constants[readOperand(chunk, offset, width)];
+    offset += width;
+    uint32_t missing = width == 1 ? UINT16_MAX : UINT32_MAX;
+    uint32_t handler = readOperand(chunk, offset, width * 2);
+    uint32_t finally = readOperand(chunk, offset + width * 2, width * 2);
+    op->a = (int32_t)handler;
+    op->b = finally == missing ? NO_TARGET : (int32_t)finally;
+    offset += width * 4;
+    break;
+  }
+  default:
+    if (isNamed(instruction)) {
+      op->value = constants[readOperand(chunk, offset, width)];
+      offset += width;
+    }
+    break;
+  }
+  return offset;
+}
+
+void decodeFunction(ObjFunction *function, const void *const *handlers) {
+  Chunk *chunk = &function->chunk;
+  // There are never more instructions than bytes, and each byte offset maps
+  // to the instruction that starts there.
+  DecodedOp *ops = malloc(sizeof(DecodedOp) * chunk->count);
+  uint8_t *opcodes = malloc(chunk->count);
+  int *targets = malloc(sizeof(int) * chunk->count);
+  int *indexAt = malloc(sizeof(int) * (chunk->count + 1));
+  if (ops == NULL || opcodes == NULL || targets == NULL || indexAt == NULL)
+    exit(1);
+
+  int count = 0;
+  for (int offset = 0; offset < chunk->count; count++) {
+    indexAt[offset] = count;
+    offset = decodeInstruction(chunk, offset, &ops[count], &opcodes[count],
+                               &targets[count]);
+  }
+  indexAt[chunk->count] = count;
+
+  // Jumps point straight at the instruction they go to, so they can only be
+  // filled in once the code is in the buffer it's going to stay in.
+  DecodedOp *code = allocatePinned(sizeof(DecodedOp) * count);
+  for (int i = 0; i < count; i++) {
+    DecodedOp *op = &code[i];
+    *op = ops[i];
+    if (targets[i] != -1)
+      op->target = &code[indexAt[targets[i]]];
+    if (opcodes[i] == OP_PUSH_EXCEPTION_HANDLER) {
+      op->a = indexAt[op->a];
+      if (op->b != NO_TARGET)
+        op->b = indexAt[op->b];
+    }
+    op->handler = handlers[opcodes[i]];
+    // The function may already be old, while the constants it was compiled
+    // with are still young.
+    writeBarrier((Obj *)function, op->value);
+  }
+
+  free(ops);
+  free(opcodes);
+  free(targets);
+  free(indexAt);
+  function->decoded = code;
+  function->decodedCount = count;
+}
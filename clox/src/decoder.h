@@ -0,0 +1,37 @@
+#ifndef clox_decoder_h
+#define clox_decoder_h
+
+#include "object.h"
+
+// An instruction decoded ahead of time, so the interpreter doesn't pick its
+// operands out of the chunk's bytes every time it runs it. Wide encodings
+// decode to the same thing as narrow ones, and instructions that only push
+// a constant - OP_SMALL_INT, OP_NIL and the like - all become OP_CONSTANT.
+typedef struct DecodedOp {
+  // The address of the code in run() that executes it.
+  const void *handler;
+  // A constant, name or function, already looked up in the constant pool.
+  // Nil for instructions that don't have one.
+  Value value;
+  // Where a jump goes.
+  struct DecodedOp *target;
+  // Slots, argument counts, immediates, call sites and the addresses of
+  // exception handlers, which are indexes of decoded instructions. A handler
+  // without a finally block has -1 for its address.
+  int32_t a;
+  int32_t b;
+  // A counted loop's limit slot and mode byte. They fit in what would
+  // otherwise be padding.
+  uint8_t c;
+  uint8_t flags;
+  // Where the instruction starts in the chunk. The chunk is still what the
+  // line table and the disassembler go by.
+  uint32_t offset;
+} DecodedOp;
+
+// Decodes a function's chunk into function->decoded, using handlers to find
+// the code for each opcode. The VM does this the first time the function is
+// called.
+void decodeFunction(ObjFunction *function, const void *const *handlers);
+
+#endif
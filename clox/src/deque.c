@@ -0,0 +1,115 @@
+#include "deque.h"
+
+#include <stdlib.h>
+
+// This follows "Correct and Efficient Work-Stealing for Weak Memory Models"
+// by Lê, Pop, Cohen and Zappa Nardelli. The deques live outside the managed
+// heap, since several threads use them at once.
+
+#define DEQUE_INITIAL_SIZE 256
+
+static DequeArray *newArray(int64_t size) {
+  DequeArray *array =
+      (DequeArray *)malloc(sizeof(DequeArray) + sizeof(Obj *) * size);
+  if (array == NULL)
+    exit(1);
+  array->size = size;
+  array->retired = NULL;
+  return array;
+}
+
+void initDeque(WorkDeque *deque) {
+  deque->top = 0;
+  deque->bottom = 0;
+  deque->array = newArray(DEQUE_INITIAL_SIZE);
+}
+
+void freeDeque(WorkDeque *deque) {
+  resetDeque(deque);
+  free(deque->array);
+  deque->array = NULL;
+}
+
+// Frees the outgrown arrays. Only safe once no other thread is stealing.
+void resetDeque(WorkDeque *deque) {
+  DequeArray *array = deque->array->retired;
+  while (array != NULL) {
+    DequeArray *next = array->retired;
+    free(array);
+    array = next;
+  }
+  deque->array->retired = NULL;
+}
+
+static DequeArray *grow(WorkDeque *deque, DequeArray *array, int64_t top,
+                        int64_t bottom) {
+  DequeArray *grown = newArray(array->size * 2);
+  for (int64_t i = top; i < bottom; i++) {
+    grown->objects[i % grown->size] = array->objects[i % array->size];
+  }
+  grown->retired = array;
+  __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+  return grown;
+}
+
+void dequePush(WorkDeque *deque, Obj *object) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  DequeArray *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+  if (bottom - top > array->size - 1) {
+    array = grow(deque, array, top, bottom);
+  }
+
+  __atomic_store_n(&array->objects[bottom % array->size], object,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// Takes the most recently pushed object, or NULL if the deque is empty.
+Obj *dequePop(WorkDeque *deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  DequeArray *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    // Empty
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  Obj *object = __atomic_load_n(&array->objects[bottom % array->size],
+                                __ATOMIC_RELAXED);
+  if (top == bottom) {
+    // This is the last one, so race any thieves for it
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      object = NULL;
+    }
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return object;
+}
+
+// Takes the oldest object, or NULL if the deque is empty or another thread
+// got there first.
+Obj *dequeSteal(WorkDeque *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+  if (top >= bottom)
+    return NULL;
+
+  DequeArray *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  Obj *object =
+      __atomic_load_n(&array->objects[top % array->size], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return object;
+}
@@ -0,0 +1,31 @@
+#ifndef clox_deque_h
+#define clox_deque_h
+
+#include "common.h"
+#include "object.h"
+
+// A Chase-Lev work-stealing deque, for the parallel marker. The thread that
+// owns it pushes and pops at the bottom, and every other thread can steal
+// from the top.
+typedef struct DequeArray {
+  int64_t size;
+  // Arrays the deque has outgrown. A thief might still be reading one, so
+  // they stick around until the deque is reset.
+  struct DequeArray *retired;
+  Obj *objects[];
+} DequeArray;
+
+typedef struct {
+  int64_t top;
+  int64_t bottom;
+  DequeArray *array;
+} WorkDeque;
+
+void initDeque(WorkDeque *deque);
+void freeDeque(WorkDeque *deque);
+void resetDeque(WorkDeque *deque);
+void dequePush(WorkDeque *deque, Obj *object);
+Obj *dequePop(WorkDeque *deque);
+Obj *dequeSteal(WorkDeque *deque);
+
+#endif
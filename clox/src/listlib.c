@@ -0,0 +1,84 @@
+#include "listlib.h"
+
+#include <math.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Checks that the first argument is a list, and throws if it isn't.
+static bool checkList(const char *name, int argCount, Value *args) {
+  if (IS_LIST(args[0]))
+    return true;
+  return nativeError(args,
+                     argCount == 1 ? "Argument to %s() must be a list."
+                                   : "First argument to %s() must be a list.",
+                     name);
+}
+
+// Adds a value to the end of the list.
+static bool pushNative(int argCount, Value *args) {
+  if (!checkList("push", argCount, args))
+    return false;
+  appendToList(AS_LIST(args[0]), args[1]);
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+// Takes the last value off the end of the list, and returns it.
+static bool popNative(int argCount, Value *args) {
+  if (!checkList("pop", argCount, args))
+    return false;
+  ObjList *list = AS_LIST(args[0]);
+  if (list->items.count == 0)
+    return nativeError(args, "Can't pop from an empty list.");
+
+  Value item = list->items.values[list->items.count - 1];
+  // The list no longer holds it, so the marker has to hear about it
+  deletionBarrier((Obj *)list, item);
+  __atomic_store_n(&list->items.count, list->items.count - 1,
+                   __ATOMIC_RELEASE);
+  args[-1] = item;
+  return true;
+}
+
+static bool lenNative(int argCount, Value *args) {
+  if (!checkList("len", argCount, args))
+    return false;
+  args[-1] = NUMBER_VAL(AS_LIST(args[0])->items.count);
+  return true;
+}
+
+// Whether a value is a whole number from 0 up to and including the limit.
+static bool isBound(Value value, int limit) {
+  if (!IS_NUMBER(value))
+    return false;
+  double number = AS_NUMBER(value);
+  return number == trunc(number) && number >= 0 && number <= limit;
+}
+
+// A new list with the elements from start up to but not including end.
+static bool sliceNative(int argCount, Value *args) {
+  if (!checkList("slice", argCount, args))
+    return false;
+  ObjList *list = AS_LIST(args[0]);
+  int count = list->items.count;
+  if (!isBound(args[1], count) || !isBound(args[2], count) ||
+      AS_NUMBER(args[1]) > AS_NUMBER(args[2])) {
+    return nativeError(args, "Slice bounds out of range.");
+  }
+
+  ObjList *slice = newList();
+  for (int i = (int)AS_NUMBER(args[1]); i < (int)AS_NUMBER(args[2]); i++) {
+    appendToList(slice, list->items.values[i]);
+  }
+  args[-1] = OBJ_VAL(slice);
+  return true;
+}
+
+void defineListNatives(void) {
+  defineNative("push", pushNative, 2);
+  defineNative("pop", popNative, 1);
+  defineNative("len", lenNative, 1);
+  defineNative("slice", sliceNative, 3);
+}
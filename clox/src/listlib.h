@@ -0,0 +1,7 @@
+#ifndef clox_listlib_h
+#define clox_listlib_h
+
+// Defines the list natives as globals: push, pop, len and slice.
+void defineListNatives(void);
+
+#endif
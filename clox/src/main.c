@@ -4,9 +4,37 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
+#include "memory.h"
 #include "prelude.h"
 #include "vm.h"
 
+// Whether to print the collector's statistics when the program is done.
+static bool showGCStats = false;
+
+static void printGCStats() {
+  char buffer[1024];
+  size_t length = formatGCStats(buffer, sizeof(buffer));
+  if (length >= sizeof(buffer)) {
+    length = sizeof(buffer) - 1;
+  }
+  fprintf(stderr, "%.*s\n", (int)length, buffer);
+}
+
+static void printStats() {
+  if (showGCStats)
+    printGCStats();
+#ifdef COUNT_DISPATCHES
+  fprintf(stderr, "%llu instructions dispatched\n",
+          (unsigned long long)vm.dispatchCount);
+#endif
+}
+
+static void finish(int status) {
+  printStats();
+  exit(status);
+}
+
 static void repl() {
   char line[1024];
 
@@ -52,30 +80,184 @@ static void runFile(const char *path) {
   free(source);
 
   if (result == INTERPRET_COMPILE_ERROR)
-    exit(65);
+    finish(65);
   if (result == INTERPRET_RUNTIME_ERROR)
-    exit(70);
+    finish(70);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: clox [options] [path]\n"
+                  "\n"
+                  "Options:\n"
+                  "  --gc-grow-factor=N    Grow the heap at most N times over "
+                  "between collections\n"
+                  "  --gc-initial-heap=SIZE\n"
+                  "                        Heap size of the first collection\n"
+                  "  --gc-cpu-fraction=F   Aim to spend this fraction of the "
+                  "time collecting\n"
+                  "  --gc-soft-limit=SIZE  Collect more often approaching this "
+                  "heap size\n"
+                  "  --gc-heap-limit=SIZE  Fail with out of memory past this "
+                  "heap size\n"
+                  "  --gc-stats            Print collector statistics as JSON "
+                  "at exit\n"
+                  "  --optimize            Optimize each function after "
+                  "compiling it\n"
+                  "  --registers           Optimize, and address locals as "
+                  "registers\n"
+                  "\n"
+                  "Sizes are in bytes, or take a K, M or G suffix. Options can "
+                  "also be set\n"
+                  "with CLOX_GC_GROW_FACTOR, CLOX_GC_INITIAL_HEAP, "
+                  "CLOX_GC_CPU_FRACTION,\n"
+                  "CLOX_GC_SOFT_LIMIT, CLOX_GC_HEAP_LIMIT, CLOX_GC_STATS,\n"
+                  "CLOX_OPTIMIZE and CLOX_REGISTERS.\n");
+  exit(64);
+}
+
+// Parses a size in bytes, with an optional K, M or G suffix.
+static size_t parseSize(const char *text) {
+  if (text == NULL)
+    usage();
+  char *end;
+  double size = strtod(text, &end);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    size *= 1024;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    size *= 1024 * 1024;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    size *= 1024 * 1024 * 1024;
+    end++;
+    break;
+  }
+  if (end == text || *end != '\0' || size < 0)
+    usage();
+  return (size_t)size;
+}
+
+static double parseFactor(const char *text) {
+  if (text == NULL)
+    usage();
+  char *end;
+  double factor = strtod(text, &end);
+  if (end == text || *end != '\0' || factor <= 1)
+    usage();
+  return factor;
+}
+
+static double parseFraction(const char *text) {
+  if (text == NULL)
+    usage();
+  char *end;
+  double fraction = strtod(text, &end);
+  if (end == text || *end != '\0' || fraction <= 0 || fraction >= 1)
+    usage();
+  return fraction;
+}
+
+// Sets one of the options, by the name it has on the command line. Returns
+// false if there's no such option.
+static bool setOption(const char *name, const char *value) {
+  if (strcmp(name, "gc-grow-factor") == 0) {
+    vm.gcConfig.growFactor = parseFactor(value);
+  } else if (strcmp(name, "gc-initial-heap") == 0) {
+    vm.gcConfig.initialHeap = parseSize(value);
+  } else if (strcmp(name, "gc-cpu-fraction") == 0) {
+    vm.gcConfig.cpuFraction = parseFraction(value);
+  } else if (strcmp(name, "gc-soft-limit") == 0) {
+    vm.gcConfig.softLimit = parseSize(value);
+  } else if (strcmp(name, "gc-heap-limit") == 0) {
+    vm.gcConfig.heapLimit = parseSize(value);
+  } else if (strcmp(name, "gc-stats") == 0) {
+    showGCStats = value == NULL || strcmp(value, "0") != 0;
+  } else if (strcmp(name, "optimize") == 0) {
+    optimizeCode = value == NULL || strcmp(value, "0") != 0;
+  } else if (strcmp(name, "registers") == 0) {
+    useRegisters = value == NULL || strcmp(value, "0") != 0;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Options come from the environment first, so the command line can
+// override them.
+static void configureFromEnvironment() {
+  static const struct {
+    const char *variable;
+    const char *option;
+  } variables[] = {
+      {"CLOX_GC_GROW_FACTOR", "gc-grow-factor"},
+      {"CLOX_GC_INITIAL_HEAP", "gc-initial-heap"},
+      {"CLOX_GC_CPU_FRACTION", "gc-cpu-fraction"},
+      {"CLOX_GC_SOFT_LIMIT", "gc-soft-limit"},
+      {"CLOX_GC_HEAP_LIMIT", "gc-heap-limit"},
+      {"CLOX_GC_STATS", "gc-stats"},
+      {"CLOX_OPTIMIZE", "optimize"},
+      {"CLOX_REGISTERS", "registers"},
+  };
+
+  for (size_t i = 0; i < sizeof(variables) / sizeof(variables[0]); i++) {
+    const char *value = getenv(variables[i].variable);
+    if (value != NULL) {
+      setOption(variables[i].option, value);
+    }
+  }
+}
+
+// Handles the options, and returns the script's path, if there is one.
+static const char *configure(int argc, const char *argv[]) {
+  configureFromEnvironment();
+
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) {
+      if (path != NULL)
+        usage();
+      path = argv[i];
+      continue;
+    }
+
+    char name[64];
+    const char *value = strchr(argv[i], '=');
+    size_t length = value != NULL ? (size_t)(value - argv[i] - 2)
+                                  : strlen(argv[i] + 2);
+    if (length >= sizeof(name))
+      usage();
+    memcpy(name, argv[i] + 2, length);
+    name[length] = '\0';
+    if (!setOption(name, value != NULL ? value + 1 : NULL))
+      usage();
+  }
+  return path;
 }
 
 int main(int argc, const char *argv[]) {
+  const char *path = configure(argc, argv);
   initVM();
 
   InterpretResult preludeResult = interpret(PRELUDE);
 
   if (preludeResult == INTERPRET_COMPILE_ERROR)
-    exit(65);
+    finish(65);
   if (preludeResult == INTERPRET_RUNTIME_ERROR)
-    exit(70);
+    finish(70);
 
-  if (argc == 1) {
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFile(path);
   }
 
+  printStats();
   freeVM();
   return 0;
 }
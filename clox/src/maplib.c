@@ -0,0 +1,106 @@
+#include "maplib.h"
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Checks that the first argument is a map, and throws if it isn't.
+static bool checkMap(const char *name, int argCount, Value *args) {
+  if (IS_MAP(args[0]))
+    return true;
+  return nativeError(args,
+                     argCount == 1 ? "Argument to %s() must be a map."
+                                   : "First argument to %s() must be a map.",
+                     name);
+}
+
+// A new, empty map. It's named like a class, since it makes one.
+static bool mapNative(int argCount, Value *args) {
+  args[-1] = OBJ_VAL(newMap());
+  return true;
+}
+
+// The value for a key, or nil if the map doesn't have it.
+static bool getNative(int argCount, Value *args) {
+  if (!checkMap("get", argCount, args))
+    return false;
+  Value value;
+  if (!valueTableGet(&AS_MAP(args[0])->table, args[1], &value))
+    value = NIL_VAL;
+  args[-1] = value;
+  return true;
+}
+
+static bool setNative(int argCount, Value *args) {
+  if (!checkMap("set", argCount, args))
+    return false;
+  // A NaN isn't equal to anything, itself included, so it could never be
+  // found again
+  if (IS_NUMBER(args[1]) && AS_NUMBER(args[1]) != AS_NUMBER(args[1]))
+    return nativeError(args, "Map key can't be NaN.");
+
+  ObjMap *map = AS_MAP(args[0]);
+  writeBarrierValueTable((Obj *)map, &map->table, args[1], args[2]);
+  valueTableSet(&map->table, args[1], args[2]);
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+static bool hasNative(int argCount, Value *args) {
+  if (!checkMap("has", argCount, args))
+    return false;
+  Value value;
+  args[-1] = BOOL_VAL(valueTableGet(&AS_MAP(args[0])->table, args[1], &value));
+  return true;
+}
+
+// Removes a key, and returns whether the map had it.
+static bool deleteNative(int argCount, Value *args) {
+  if (!checkMap("delete", argCount, args))
+    return false;
+  ObjMap *map = AS_MAP(args[0]);
+  Value value;
+  bool found = valueTableGet(&map->table, args[1], &value);
+  if (found) {
+    // Both halves of the entry are going, so the marker has to hear about
+    // them
+    deletionBarrier((Obj *)map, args[1]);
+    deletionBarrier((Obj *)map, value);
+    valueTableDelete(&map->table, args[1]);
+  }
+  args[-1] = BOOL_VAL(found);
+  return true;
+}
+
+static bool sizeNative(int argCount, Value *args) {
+  if (!checkMap("size", argCount, args))
+    return false;
+  args[-1] = NUMBER_VAL(AS_MAP(args[0])->table.size);
+  return true;
+}
+
+// A new list of the map's keys, in no particular order. It's a copy, so the
+// map can be changed while going through them.
+static bool keysNative(int argCount, Value *args) {
+  if (!checkMap("keys", argCount, args))
+    return false;
+  ValueTable *table = &AS_MAP(args[0])->table;
+  ObjList *keys = newList();
+  for (int i = 0; i < table->capacity; i++) {
+    if (isValueEntry(&table->entries[i])) {
+      appendToList(keys, table->entries[i].key);
+    }
+  }
+  args[-1] = OBJ_VAL(keys);
+  return true;
+}
+
+void defineMapNatives(void) {
+  defineNative("Map", mapNative, 0);
+  defineNative("get", getNative, 2);
+  defineNative("set", setNative, 3);
+  defineNative("has", hasNative, 2);
+  defineNative("delete", deleteNative, 2);
+  defineNative("size", sizeNative, 1);
+  defineNative("keys", keysNative, 1);
+}
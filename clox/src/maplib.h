@@ -0,0 +1,8 @@
+#ifndef clox_maplib_h
+#define clox_maplib_h
+
+// Defines the map natives as globals: Map, get, set, has, delete, size and
+// keys.
+void defineMapNatives(void);
+
+#endif
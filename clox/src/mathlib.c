@@ -0,0 +1,127 @@
+#include "mathlib.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+
+// Checks that every argument is a number, and throws if one isn't.
+static bool checkNumbers(const char *name, int argCount, Value *args) {
+  for (int i = 0; i < argCount; i++) {
+    if (!IS_NUMBER(args[i])) {
+      return nativeError(args,
+                         argCount == 1 ? "Argument to %s() must be a number."
+                                       : "Arguments to %s() must be numbers.",
+                         name);
+    }
+  }
+  return true;
+}
+
+// Natives that apply a function from math.h to their one argument.
+#define UNARY_NATIVE(name, function)                                           \
+  static bool name##Native(int argCount, Value *args) {                        \
+    if (!checkNumbers(#name, argCount, args))                                  \
+      return false;                                                            \
+    args[-1] = NUMBER_VAL(function(AS_NUMBER(args[0])));                       \
+    return true;                                                               \
+  }
+
+UNARY_NATIVE(abs, fabs)
+UNARY_NATIVE(floor, floor)
+UNARY_NATIVE(ceil, ceil)
+UNARY_NATIVE(sqrt, sqrt)
+UNARY_NATIVE(sin, sin)
+UNARY_NATIVE(cos, cos)
+
+#undef UNARY_NATIVE
+
+static bool powNative(int argCount, Value *args) {
+  if (!checkNumbers("pow", argCount, args))
+    return false;
+  args[-1] = NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+  return true;
+}
+
+// Like the comparison operators, a NaN on either side makes the comparison
+// false, so which one comes back depends on the order.
+static bool minNative(int argCount, Value *args) {
+  if (!checkNumbers("min", argCount, args))
+    return false;
+  double a = AS_NUMBER(args[0]);
+  double b = AS_NUMBER(args[1]);
+  args[-1] = NUMBER_VAL(b < a ? b : a);
+  return true;
+}
+
+static bool maxNative(int argCount, Value *args) {
+  if (!checkNumbers("max", argCount, args))
+    return false;
+  double a = AS_NUMBER(args[0]);
+  double b = AS_NUMBER(args[1]);
+  args[-1] = NUMBER_VAL(b > a ? b : a);
+  return true;
+}
+
+// xorshift64*, seeded from the clock when the VM starts. Good enough for
+// scripts, and much faster than anything cryptographic.
+static uint64_t randomState;
+
+// A number from 0 up to but not including 1.
+static bool randomNative(int argCount, Value *args) {
+  randomState ^= randomState >> 12;
+  randomState ^= randomState << 25;
+  randomState ^= randomState >> 27;
+  uint64_t bits = randomState * 0x2545f4914f6cdd1dull;
+  // The top 53 bits, which is all a double can hold.
+  args[-1] = NUMBER_VAL((double)(bits >> 11) * 0x1.0p-53);
+  return true;
+}
+
+#define INTRINSIC(op, name, arity)                                             \
+  [op - OP_ABS] = {name, sizeof(name) - 1, arity}
+
+const Intrinsic intrinsics[INTRINSIC_COUNT] = {
+    INTRINSIC(OP_ABS, "abs", 1),   INTRINSIC(OP_FLOOR, "floor", 1),
+    INTRINSIC(OP_CEIL, "ceil", 1), INTRINSIC(OP_SQRT, "sqrt", 1),
+    INTRINSIC(OP_SIN, "sin", 1),   INTRINSIC(OP_COS, "cos", 1),
+    INTRINSIC(OP_POW, "pow", 2),   INTRINSIC(OP_MIN, "min", 2),
+    INTRINSIC(OP_MAX, "max", 2),
+};
+
+#undef INTRINSIC
+
+int findIntrinsic(const char *name, int length) {
+  for (int i = 0; i < INTRINSIC_COUNT; i++) {
+    if (intrinsics[i].length == length &&
+        memcmp(intrinsics[i].name, name, length) == 0) {
+      return OP_ABS + i;
+    }
+  }
+  return -1;
+}
+
+void defineMathNatives(void) {
+  // The state must never be zero.
+  randomState = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ull | 1;
+
+  defineNative("abs", absNative, 1);
+  defineNative("floor", floorNative, 1);
+  defineNative("ceil", ceilNative, 1);
+  defineNative("sqrt", sqrtNative, 1);
+  defineNative("pow", powNative, 2);
+  defineNative("sin", sinNative, 1);
+  defineNative("cos", cosNative, 1);
+  defineNative("min", minNative, 2);
+  defineNative("max", maxNative, 2);
+  defineNative("random", randomNative, 0);
+
+  // Globals are stored to all the time, so rather than looking the name up
+  // on every store, each intrinsic's name says which one it is. The globals
+  // table keeps the names alive.
+  for (int i = 0; i < INTRINSIC_COUNT; i++) {
+    copyString(intrinsics[i].name, intrinsics[i].length)->intrinsic = i;
+  }
+}
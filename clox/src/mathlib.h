@@ -0,0 +1,25 @@
+#ifndef clox_mathlib_h
+#define clox_mathlib_h
+
+#include "chunk.h"
+
+// Defines the math natives as globals: abs, floor, ceil, sqrt, pow, sin, cos,
+// min, max and random.
+void defineMathNatives(void);
+
+// The natives the compiler has instructions for, from OP_ABS to OP_MAX.
+typedef struct {
+  const char *name;
+  int length;
+  int arity;
+} Intrinsic;
+
+#define INTRINSIC_COUNT (OP_MAX - OP_ABS + 1)
+
+extern const Intrinsic intrinsics[INTRINSIC_COUNT];
+
+// Returns the instruction for calls to the global with this name, or -1 if
+// there isn't one.
+int findIntrinsic(const char *name, int length);
+
+#endif
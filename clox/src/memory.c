@@ -1,44 +1,328 @@
 #include "memory.h"
 #include "compiler.h"
+#include "decoder.h"
 
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef GC_CONCURRENT_MARK
+#include <pthread.h>
+#include <sched.h>
+
+#include "deque.h"
+#endif
 
 #include "vm.h"
 
+#if defined(GC_COMPACT) && defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
-#include <stdio.h>
 #endif
 
+// Defaults for what GCConfig leaves unset.
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_CPU_FRACTION 0.1
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
-  if (newSize > oldSize) {
+// However fast the program allocates, the heap gets to grow by at least this
+// fraction of what's live between cycles...
+#define GC_MIN_GROWTH 0.125
+// ...and when it's up against the soft limit, the collector still won't take
+// more than this fraction of the time.
+#define GC_MAX_CPU_FRACTION 0.5
+
+// How many objects an incremental step gets to blacken or sweep before it
+// hands control back to the program. Marking only happens in steps when it
+// can't have a thread of its own.
+#ifndef GC_STEP_BUDGET
+#define GC_STEP_BUDGET 256
+#endif
+
+// How many threads mark in parallel. Zero means one per core.
+#ifndef GC_MARK_THREADS
+#define GC_MARK_THREADS 0
+#endif
+
+// Objects in the nursery are packed back to back, so round their sizes up to
+// keep the next one aligned.
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+static void deferFree(void *pointer, size_t size);
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// What the pacer measures to decide when the next cycle starts. The rates
+// and costs are smoothed over past cycles.
+static struct {
+  // Every byte the old generation has grown by, ignoring what's been freed.
+  size_t allocated;
+  // When the last cycle ended, and how much had been allocated by then.
+  double lastEnd;
+  size_t allocatedAtLastEnd;
+  // When the current cycle started, and how long the program had spent
+  // paused for collections by then.
+  double cycleStart;
+  double pauseAtStart;
+
+  // How fast the old generation grows, in bytes per second.
+  double allocationRate;
+  // How long a cycle pauses the program for in total, and how long it takes
+  // from start to finish, in seconds.
+  double cycleCost;
+  double cycleDuration;
+  // The heap size the last cycle aimed to stay under.
+  size_t goal;
+} pacer;
+
+// We can't collect right when memory gets allocated, since the caller may be
+// holding pointers to young objects that a minor collection would move.
+// Instead, ask for a collection at the next safepoint.
+static void requestCollection() {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+  vm.gcRequested = true;
 #endif
 
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
-    }
+  // While a cycle is underway, the collector takes a step every time the
+  // program allocates, so it keeps up with the mutator
+  if (vm.bytesAllocated > vm.nextGC || vm.gcPhase != GC_IDLE) {
+    vm.gcRequested = true;
   }
+  if (vm.gcConfig.heapLimit != 0 && vm.bytesAllocated > vm.gcConfig.heapLimit) {
+    vm.gcRequested = true;
+  }
+}
 
-  if (newSize == 0) {
+static void *allocateBuffer(size_t size) {
+  if (isPooled(size))
+    return poolAllocate(&vm.buffers, size);
+
+  void *result = malloc(size);
+  if (result == NULL)
+    exit(1);
+  return result;
+}
+
+static void freeBuffer(void *pointer, size_t size) {
+  if (isPooled(size)) {
+    poolFree(&vm.buffers, pointer, size);
+  } else {
     free(pointer);
+  }
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  // Count what the buffers really take up, rounded up to their size class
+  vm.bytesAllocated += pooledSize(newSize) - pooledSize(oldSize);
+  if (newSize > oldSize) {
+    pacer.allocated += pooledSize(newSize) - pooledSize(oldSize);
+    requestCollection();
+  }
+
+  // Growing or shrinking within a size class leaves the buffer where it is
+  if (pointer != NULL && isPooled(oldSize) && isPooled(newSize) &&
+      POOL_CLASS(oldSize) == POOL_CLASS(newSize)) {
+    return pointer;
+  }
+
+  bool deferred = false;
+#ifdef GC_CONCURRENT_MARK
+  // The marker could be in the middle of reading a table or array that's
+  // being resized or freed, so hang on to the old memory for now
+  deferred = vm.gcPhase == GC_MARKING;
+#endif
+
+  if (newSize == 0) {
+    if (pointer != NULL && deferred) {
+      deferFree(pointer, oldSize);
+    } else if (pointer != NULL) {
+      freeBuffer(pointer, oldSize);
+    }
     return NULL;
   }
 
-  void *result = realloc(pointer, newSize);
+  // Large buffers can still make use of realloc growing them in place
+  if (pointer != NULL && !deferred && !isPooled(oldSize) &&
+      !isPooled(newSize)) {
+    void *result = realloc(pointer, newSize);
+    if (result == NULL)
+      exit(1);
+    return result;
+  }
+
+  void *result = allocateBuffer(newSize);
+  if (pointer != NULL) {
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    if (deferred) {
+      deferFree(pointer, oldSize);
+    } else {
+      freeBuffer(pointer, oldSize);
+    }
+  }
+  return result;
+}
+
+void *allocatePinned(size_t size) {
+  vm.bytesAllocated += size;
+  pacer.allocated += size;
+  requestCollection();
+
+  void *result = malloc(size);
   if (result == NULL)
     exit(1);
   return result;
 }
 
+void freePinned(void *pointer, size_t size) {
+  if (pointer == NULL)
+    return;
+  vm.bytesAllocated -= size;
+  free(pointer);
+}
+
+// Bump-allocates in the nursery. Returns NULL if the nursery is full, in
+// which case the caller has to allocate in the old generation instead.
+void *allocateYoung(size_t size) {
+  size = NURSERY_ALIGN(size);
+  if (vm.nurseryTop + size > vm.nurseryEnd) {
+    vm.gcRequested = true;
+    vm.nurseryFull = true;
+    return NULL;
+  }
+  if (vm.gcPhase != GC_IDLE) {
+    vm.gcRequested = true;
+  }
+
+  void *result = vm.nurseryTop;
+  vm.nurseryTop += size;
+  return result;
+}
+
+static void freeOldObject(Obj *object);
+
+// Pages the current cycle hasn't gotten to yet still hold its dead objects.
+static void sweepOldPage(Page *page) {
+  int freed = sweepPage(page, vm.sweepEpoch, freeOldObject);
+  vm.bytesAllocated -= (size_t)freed * page->slotSize;
+  vm.gcStats.bytesFreed += (size_t)freed * page->slotSize;
+}
+
+// Allocates a slot in the old generation, sweeping pages on the way if a
+// cycle has just finished marking.
+Obj *allocateOld(size_t size) {
+  SizeClass *sizeClass = &vm.sizeClasses[SIZE_CLASS(size)];
+  Obj *object = NULL;
+  while (sizeClass->allocating != NULL) {
+    Page *page = sizeClass->allocating;
+    if (page->epoch != vm.sweepEpoch) {
+      sweepOldPage(page);
+    }
+    object = takeSlot(page);
+    if (object != NULL)
+      break;
+    sizeClass->allocating = page->next;
+  }
+
+  if (object == NULL) {
+    Page *page = newPage(SIZE_CLASS(size) * SIZE_CLASS_STEP, vm.sweepEpoch);
+    if (sizeClass->tail != NULL) {
+      sizeClass->tail->next = page;
+    } else {
+      sizeClass->pages = page;
+    }
+    sizeClass->tail = page;
+    sizeClass->allocating = page;
+    object = takeSlot(page);
+  }
+
+  vm.bytesAllocated += pageOf(object)->slotSize;
+  pacer.allocated += pageOf(object)->slotSize;
+  requestCollection();
+  return object;
+}
+
+static size_t objectSize(ObjType type) {
+  switch (type) {
+  case OBJ_BOUND_METHOD:
+    return sizeof(ObjBoundMethod);
+  case OBJ_CLASS:
+    return sizeof(ObjClass);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure);
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_INSTANCE:
+    return sizeof(ObjInstance);
+  case OBJ_LIST:
+    return sizeof(ObjList);
+  case OBJ_MAP:
+    return sizeof(ObjMap);
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_STRING:
+    return sizeof(ObjString);
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  }
+  return 0; // Unreachable.
+}
+
+// Pushes onto one of the collector's worklists, growing it if needed.
+static Obj **pushObject(Obj **stack, int *count, int *capacity, Obj *object) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    // Call system realloc, since these stacks are managed manually and are
+    // NOT garbage collected
+    stack = (Obj **)realloc(stack, sizeof(Obj *) * *capacity);
+    // Make sure there isn't an allocation failure. In practice, we would do
+    // something more graceful than hard exit.
+    if (stack == NULL)
+      exit(1);
+  }
+
+  stack[(*count)++] = object;
+  return stack;
+}
+
+static void pushGray(Obj *object) {
+  vm.grayStack =
+      pushObject(vm.grayStack, &vm.grayCount, &vm.grayCapacity, object);
+}
+
+#ifdef GC_CONCURRENT_MARK
+// One of the threads marking in parallel. Each has its own deque of gray
+// objects, and steals from the others once it runs dry.
+typedef struct {
+  pthread_t thread;
+  WorkDeque deque;
+} MarkWorker;
+
+// Set on the marker threads, so markObject knows where to put what it marks
+static _Thread_local MarkWorker *currentWorker = NULL;
+#endif
+
 void markObject(Obj *object) {
   if (object == NULL)
     return;
-  if (object->isMarked)
+  // The nursery isn't part of the mark - young objects didn't exist when
+  // marking started, and on a young object this flag means it's been
+  // forwarded
+  if (isYoung(object))
+    return;
+  // Several marker threads can reach the same object at once. Only the one
+  // that actually sets the bit gets to push it.
+  if (isMarkedInPage(object) || !markInPage(object))
     return;
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void *)object);
@@ -46,23 +330,15 @@ void markObject(Obj *object) {
   printf("\n");
 #endif
 
-  object->isMarked = true;
-
   // Push the object onto the gray stack, since we haven't traversed its
   // children
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    // Call system realloc, since the gray stack's memory is managed manually
-    // and is NOT garbage collected
-    vm.grayStack =
-        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
-    // Make sure there isn't an allocation failure. In practice, we would do
-    // something more graceful than hard exit.
-    if (vm.grayStack == NULL)
-      exit(1);
+#ifdef GC_CONCURRENT_MARK
+  if (currentWorker != NULL) {
+    dequePush(&currentWorker->deque, object);
+    return;
   }
-
-  vm.grayStack[vm.grayCount++] = object;
+#endif
+  pushGray(object);
 }
 
 void markValue(Value value) {
@@ -73,11 +349,215 @@ void markValue(Value value) {
 }
 
 void markArray(ValueArray *array) {
-  for (int i = 0; i < array->count; i++) {
+  // The compiler may still be adding to this array
+  int count = __atomic_load_n(&array->count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
     markValue(array->values[i]);
   }
 }
 
+// Adds an old object to the remembered set, so the next minor collection
+// will update any pointers it has into the nursery.
+void rememberObject(Obj *object) {
+  if (object->isRemembered || isYoung(object))
+    return;
+  object->isRemembered = true;
+  vm.remembered = pushObject(vm.remembered, &vm.rememberedCount,
+                             &vm.rememberedCapacity, object);
+}
+
+// Logs an object the marker has to see, even if the program can no longer
+// reach it the way it could when marking started.
+void shadeObject(Obj *object) {
+  if (vm.gcPhase != GC_MARKING || isYoung(object) || isMarkedInPage(object))
+    return;
+  vm.satbLog = pushObject(vm.satbLog, &vm.satbCount, &vm.satbCapacity, object);
+}
+
+// Keeps a string the intern table handed back alive. The table is weak, so
+// while marking, the string may not have been in the snapshot at all. While
+// sweeping, it may be dead and just not swept yet, in which case marking it
+// brings it back before the sweep gets to it.
+void retainInterned(ObjString *string) {
+  Obj *object = (Obj *)string;
+  if (vm.gcPhase == GC_MARKING) {
+    shadeObject(object);
+  } else if (vm.gcPhase == GC_SWEEPING && !isYoung(object) &&
+             pageOf(object)->epoch != vm.sweepEpoch) {
+    markInPage(object);
+  }
+}
+
+// Objects that enter the old generation during marking are black. Anything
+// they point to was either reachable when marking started, or is new too.
+void markNewObject(Obj *object) {
+  if (vm.gcPhase == GC_MARKING) {
+    markInPage(object);
+  }
+}
+
+static void deferFree(void *pointer, size_t size) {
+  if (vm.deferredCapacity < vm.deferredCount + 1) {
+    vm.deferredCapacity = GROW_CAPACITY(vm.deferredCapacity);
+    vm.deferredFrees = (DeferredFree *)realloc(
+        vm.deferredFrees, sizeof(DeferredFree) * vm.deferredCapacity);
+    if (vm.deferredFrees == NULL)
+      exit(1);
+  }
+
+  vm.deferredFrees[vm.deferredCount].pointer = pointer;
+  vm.deferredFrees[vm.deferredCount].size = size;
+  vm.deferredCount++;
+}
+
+static void freeDeferred() {
+  for (int i = 0; i < vm.deferredCount; i++) {
+    freeBuffer(vm.deferredFrees[i].pointer, vm.deferredFrees[i].size);
+  }
+  vm.deferredCount = 0;
+}
+
+// Set while compaction is fixing up references to the objects it moved.
+static bool compacting = false;
+
+// Where a moved object keeps the address of its copy. The header's too small
+// to hold it, so it goes in the first pointer-sized word after the start,
+// which every kind of object has room for. Nothing reads the original's
+// fields once it's moved - apart from a string's hash, which the intern
+// table may still probe by until the minor collection is over.
+static inline Obj **forwardingAddress(Obj *object) {
+  return (Obj **)((uint8_t *)object + sizeof(Obj *));
+}
+
+_Static_assert(offsetof(ObjString, hash) >= 2 * sizeof(Obj *),
+               "a forwarding address can't overlap a string's hash");
+
+// Copies an object into the old generation, leaving a forwarding address
+// behind for anyone else pointing at the original.
+static Obj *moveObject(Obj *object) {
+  size_t size = objectSize(object->type);
+  Obj *copy = allocateOld(size);
+  memcpy(copy, object, size);
+
+  // A closed upvalue points at its own closed field, which just moved.
+  if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    if (upvalue->location == &upvalue->closed) {
+      ((ObjUpvalue *)copy)->location = &((ObjUpvalue *)copy)->closed;
+    }
+  }
+
+  object->isMarked = true;
+  *forwardingAddress(object) = copy;
+  return copy;
+}
+
+// Copies a young object into the old generation. The copy goes on the
+// promoted stack, since whatever it points to in the nursery has to be copied
+// too.
+static Obj *promoteObject(Obj *object) {
+  Obj *copy = moveObject(object);
+  vm.gcStats.bytesPromoted += objectSize(copy->type);
+
+#ifdef DEBUG_LOG_GC
+  printf("%p promote to %p\n", (void *)object, (void *)copy);
+#endif
+
+  vm.promotedStack = pushObject(vm.promotedStack, &vm.promotedCount,
+                                &vm.promotedCapacity, copy);
+  markNewObject(copy);
+  return copy;
+}
+
+// Returns where a (possibly young) object lives after the current minor
+// collection, promoting it if nothing has done so yet. Old objects only move
+// when the heap is being compacted.
+Obj *forwardObject(Obj *object) {
+  if (object == NULL)
+    return object;
+  if (!isYoung(object))
+    return compacting && object->isMarked ? *forwardingAddress(object)
+                                          : object;
+  if (object->isMarked)
+    return *forwardingAddress(object);
+  return promoteObject(object);
+}
+
+Value forwardValue(Value value) {
+  if (IS_OBJ(value))
+    return OBJ_VAL(forwardObject(AS_OBJ(value)));
+  return value;
+}
+
+static void forwardArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    array->values[i] = forwardValue(array->values[i]);
+  }
+}
+
+// The minor collection's version of blackenObject - instead of marking what
+// an object points to, it updates those pointers to the promoted copies.
+static void forwardReferences(Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    bound->receiver = forwardValue(bound->receiver);
+    bound->method = (ObjClosure *)forwardObject((Obj *)bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *cls = (ObjClass *)object;
+    cls->name = (ObjString *)forwardObject((Obj *)cls->name);
+    forwardTable(&cls->methods);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    closure->function = (ObjFunction *)forwardObject((Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      closure->upvalues[i] =
+          (ObjUpvalue *)forwardObject((Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    function->name = (ObjString *)forwardObject((Obj *)function->name);
+    forwardArray(&function->chunk.constants);
+    for (int i = 0; i < function->callSiteCount; i++) {
+      CallSite *site = &function->callSites[i];
+      site->cls = (ObjClass *)forwardObject((Obj *)site->cls);
+      site->method = (ObjClosure *)forwardObject((Obj *)site->method);
+    }
+    // Decoded instructions hold copies of the constants they use.
+    for (int i = 0; i < function->decodedCount; i++) {
+      function->decoded[i].value = forwardValue(function->decoded[i].value);
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    instance->cls = (ObjClass *)forwardObject((Obj *)instance->cls);
+    forwardTable(&instance->fields);
+    break;
+  }
+  case OBJ_LIST:
+    forwardArray(&((ObjList *)object)->items);
+    break;
+  case OBJ_MAP:
+    forwardValueTable(&((ObjMap *)object)->table);
+    break;
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    upvalue->closed = forwardValue(upvalue->closed);
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
 static void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void *)object);
@@ -113,6 +593,10 @@ static void blackenObject(Obj *object) {
     markObject((Obj *)function->name);
     // The function's constants are various objects
     markArray(&function->chunk.constants);
+    for (int i = 0; i < function->callSiteCount; i++) {
+      markObject((Obj *)function->callSites[i].cls);
+      markObject((Obj *)function->callSites[i].method);
+    }
     break;
   }
   case OBJ_INSTANCE: {
@@ -121,6 +605,12 @@ static void blackenObject(Obj *object) {
     markTable(&instance->fields);
     break;
   }
+  case OBJ_LIST:
+    markArray(&((ObjList *)object)->items);
+    break;
+  case OBJ_MAP:
+    markValueTable(&((ObjMap *)object)->table);
+    break;
   case OBJ_UPVALUE:
     // Marked the upvalue's closed-over value
     markValue(((ObjUpvalue *)object)->closed);
@@ -134,65 +624,80 @@ static void blackenObject(Obj *object) {
   }
 }
 
-static void freeObject(Obj *object) {
-#ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void *)object, object->type);
-#endif
+// Frees the memory an object owns, but not the object itself. Young objects
+// die in place in the nursery, so this is all they need.
+static void freeObjectContents(Obj *object) {
   switch (object->type) {
-  case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, object);
-    break;
   case OBJ_CLASS: {
     ObjClass *cls = (ObjClass *)object;
     freeTable(&cls->methods);
-    FREE(ObjClass, object);
     break;
   }
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
     // Doesn't own the upvalues themselves, just the array
     FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    FREE_ARRAY(CallSite, function->callSites, function->callSiteCount);
+    freePinned(function->decoded, sizeof(DecodedOp) * function->decodedCount);
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
     freeTable(&instance->fields);
-    FREE(ObjInstance, object);
     break;
   }
-  case OBJ_NATIVE: {
-    FREE(ObjNative, object);
+  case OBJ_LIST:
+    freeValueArray(&((ObjList *)object)->items);
+    break;
+  case OBJ_MAP:
+    freeValueTable(&((ObjMap *)object)->table);
     break;
-  }
   case OBJ_STRING: {
     ObjString *string = (ObjString *)object;
     FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
     break;
   }
+  // Note, we don't free the variable an upvalue points to
+  case OBJ_BOUND_METHOD:
+  case OBJ_NATIVE:
   case OBJ_UPVALUE:
-    // Note, we don't free the variable itself
-    FREE(ObjUpvalue, object);
     break;
   }
 }
 
+// The slot itself goes back to its page.
+static void freeOldObject(Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)object, object->type);
+#endif
+  // The intern table is weak. Dead strings stay in it until they're swept,
+  // so the cost of clearing them out is part of sweeping the garbage,
+  // rather than a scan of the whole table every cycle.
+  if (object->type == OBJ_STRING) {
+    tableRemoveKey(&vm.strings, (ObjString *)object);
+  }
+  freeObjectContents(object);
+}
+
 static void markRoots() {
   // Mark values in the stack
   for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
     markValue(*slot);
   }
 
-  // Mark closure objects stored in open frames
+  // Mark closure objects stored in open frames, along with the classes
+  // their exception handlers are waiting to catch
   for (int i = 0; i < vm.frameCount; i++) {
-    markObject((Obj *)vm.frames[i].closure);
+    CallFrame *frame = &vm.frames[i];
+    markObject((Obj *)frame->closure);
+    for (int j = 0; j < frame->handlerCount; j++) {
+      markValue(frame->handlerStack[j].cls);
+    }
   }
 
   // Mark open upvalue objects
@@ -210,71 +715,1050 @@ static void markRoots() {
   markObject((Obj *)vm.initString);
 }
 
+// Same roots as markRoots, but updating them to point out of the nursery.
+static void forwardRoots() {
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    *slot = forwardValue(*slot);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    CallFrame *frame = &vm.frames[i];
+    frame->closure = (ObjClosure *)forwardObject((Obj *)frame->closure);
+    for (int j = 0; j < frame->handlerCount; j++) {
+      frame->handlerStack[j].cls = forwardValue(frame->handlerStack[j].cls);
+    }
+  }
+
+  // The open upvalue list is threaded through the upvalues themselves, so
+  // each link needs updating
+  vm.openUpvalues = (ObjUpvalue *)forwardObject((Obj *)vm.openUpvalues);
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->next = (ObjUpvalue *)forwardObject((Obj *)upvalue->next);
+  }
+
+  // Globals only point into the nursery if the write barrier said so
+  if (vm.globalsRemembered) {
+    forwardTable(&vm.globals);
+  }
+
+  forwardCompilerRoots();
+  vm.initString = (ObjString *)forwardObject((Obj *)vm.initString);
+}
+
+// Walks every object in the nursery. The ones that weren't promoted are
+// garbage, but they may still own buffers that need freeing.
+static void sweepNursery() {
+  uint8_t *cursor = vm.nurseryStart;
+  while (cursor < vm.nurseryTop) {
+    Obj *object = (Obj *)cursor;
+    cursor += NURSERY_ALIGN(objectSize(object->type));
+
+    // The strings table is weak, so it never forwarded its keys. Fix that
+    // up here instead of scanning the whole table.
+    if (object->type == OBJ_STRING) {
+      if (object->isMarked) {
+        tableReplaceKey(&vm.strings, (ObjString *)object,
+                        (ObjString *)*forwardingAddress(object));
+      } else {
+        tableRemoveKey(&vm.strings, (ObjString *)object);
+      }
+    }
+
+    if (!object->isMarked) {
+#ifdef DEBUG_LOG_GC
+      printf("%p free young type %d\n", (void *)object, object->type);
+#endif
+      freeObjectContents(object);
+      vm.gcStats.bytesFreed += objectSize(object->type);
+    }
+  }
+}
+
+// Empties the nursery by copying everything reachable from the roots or the
+// remembered set into the old generation.
+static void minorCollection() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t young = vm.nurseryTop - vm.nurseryStart;
+  size_t before = vm.bytesAllocated;
+#endif
+  vm.gcStats.minorCollections++;
+
+  forwardRoots();
+
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj *object = vm.remembered[i];
+    object->isRemembered = false;
+    forwardReferences(object);
+  }
+  vm.rememberedCount = 0;
+  vm.globalsRemembered = false;
+
+  // Promoted objects can point to more young objects, which get promoted in
+  // turn until the promoted stack runs dry
+  while (vm.promotedCount > 0) {
+    forwardReferences(vm.promotedStack[--vm.promotedCount]);
+  }
+
+  sweepNursery();
+#ifdef DEBUG_STRESS_GC
+  // Scribble over the old nursery contents, so a pointer that missed the
+  // write barrier blows up instead of quietly reading a dead object
+  memset(vm.nurseryStart, 0xab, vm.nurseryTop - vm.nurseryStart);
+#endif
+  vm.nurseryTop = vm.nurseryStart;
+  vm.nurseryFull = false;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes out of %zu in the nursery\n",
+         vm.bytesAllocated - before, young);
+#endif
+}
+
+#ifndef GC_CONCURRENT_MARK
 static void traceReferences() {
   while (vm.grayCount > 0) {
     Obj *object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
   }
 }
+#endif
 
-static void sweep() {
-  Obj *previous = NULL;
-  Obj *object = vm.objects;
+#ifdef GC_CONCURRENT_MARK
+// The marker threads, and what they share with the interpreter. Apart from
+// the deques and the active count, everything is guarded by the lock. While
+// the markers are working, they own everything gray.
+static struct {
+  bool started;
+  pthread_mutex_t lock;
+  // Signalled when there's marking to do, or the threads should quit
+  pthread_cond_t wake;
+  // Signalled when the markers run out of work
+  pthread_cond_t idle;
+  bool working;
+  bool quit;
+  // Objects the write barrier logged, waiting for the markers to pick up
+  int handoffCount;
+  int handoffCapacity;
+  Obj **handoff;
 
-  // Iterate over all objects
-  while (object != NULL) {
-    if (object->isMarked) {
-      // Object is marked, we wanna keep it
+  // Worker zero runs the show, and the rest help out a round at a time. A
+  // round ends once every worker has run out of things to mark or steal.
+  int workerCount;
+  MarkWorker *workers;
+  pthread_cond_t roundStart;
+  pthread_cond_t roundEnd;
+  int round;
+  int finished;
+  // How many workers might still be holding gray objects
+  int active;
+} marker = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .wake = PTHREAD_COND_INITIALIZER,
+            .idle = PTHREAD_COND_INITIALIZER,
+            .roundStart = PTHREAD_COND_INITIALIZER,
+            .roundEnd = PTHREAD_COND_INITIALIZER};
 
-      // Reset so we get clean state the next time we markensweep
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      // Object is unreachable because we didn't mark it
-      Obj *unreached = object;
-      // Pull the unreached object out of the linked list of objects
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
+static Obj *stealWork(MarkWorker *worker) {
+  int self = (int)(worker - marker.workers);
+  for (int i = 1; i < marker.workerCount; i++) {
+    MarkWorker *victim = &marker.workers[(self + i) % marker.workerCount];
+    Obj *object = dequeSteal(&victim->deque);
+    if (object != NULL)
+      return object;
+  }
+  return NULL;
+}
+
+// Blackens objects until every worker has run dry. A worker only ever pushes
+// onto its own deque, so once none of them are active, there's nothing left.
+static void drainWork(MarkWorker *worker) {
+  for (;;) {
+    Obj *object;
+    while ((object = dequePop(&worker->deque)) != NULL) {
+      blackenObject(object);
+    }
 
-      // FREEDOM!!!
-      freeObject(unreached);
+    __atomic_sub_fetch(&marker.active, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&marker.active, __ATOMIC_SEQ_CST) == 0)
+        return;
+      object = stealWork(worker);
+      if (object != NULL)
+        break;
+      sched_yield();
     }
+    __atomic_add_fetch(&marker.active, 1, __ATOMIC_SEQ_CST);
+    blackenObject(object);
   }
 }
 
-void collectGarbage() {
+// Runs one round of parallel marking, from whatever is in worker zero's
+// deque. Called by worker zero without the lock.
+static void markInParallel() {
+  __atomic_store_n(&marker.active, marker.workerCount, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&marker.lock);
+  marker.round++;
+  marker.finished = 0;
+  pthread_cond_broadcast(&marker.roundStart);
+  pthread_mutex_unlock(&marker.lock);
+
+  drainWork(&marker.workers[0]);
+
+  pthread_mutex_lock(&marker.lock);
+  while (marker.finished < marker.workerCount - 1) {
+    pthread_cond_wait(&marker.roundEnd, &marker.lock);
+  }
+  pthread_mutex_unlock(&marker.lock);
+
+  // Nobody is stealing anymore, so the deques can let go of old arrays
+  for (int i = 0; i < marker.workerCount; i++) {
+    resetDeque(&marker.workers[i].deque);
+  }
+}
+
+static void *runHelper(void *arg) {
+  MarkWorker *worker = (MarkWorker *)arg;
+  currentWorker = worker;
+
+  // Rounds are counted from when the workers start, since the first one
+  // could begin before this thread gets going
+  int round = 0;
+  pthread_mutex_lock(&marker.lock);
+  for (;;) {
+    while (marker.round == round && !marker.quit) {
+      pthread_cond_wait(&marker.roundStart, &marker.lock);
+    }
+    if (marker.quit)
+      break;
+    round = marker.round;
+
+    pthread_mutex_unlock(&marker.lock);
+    drainWork(worker);
+    pthread_mutex_lock(&marker.lock);
+
+    marker.finished++;
+    pthread_cond_signal(&marker.roundEnd);
+  }
+  pthread_mutex_unlock(&marker.lock);
+  return NULL;
+}
+
+static void *runMarker(void *arg) {
+  currentWorker = &marker.workers[0];
+
+  pthread_mutex_lock(&marker.lock);
+  for (;;) {
+    while (!marker.working && !marker.quit) {
+      pthread_cond_wait(&marker.wake, &marker.lock);
+    }
+    if (marker.quit)
+      break;
+
+    // Keep going until nothing new has been logged. The marking itself
+    // happens without the lock.
+    do {
+      while (vm.grayCount > 0) {
+        dequePush(&currentWorker->deque, vm.grayStack[--vm.grayCount]);
+      }
+      while (marker.handoffCount > 0) {
+        markObject(marker.handoff[--marker.handoffCount]);
+      }
+      pthread_mutex_unlock(&marker.lock);
+      markInParallel();
+      pthread_mutex_lock(&marker.lock);
+    } while (marker.handoffCount > 0);
+
+    marker.working = false;
+    pthread_cond_signal(&marker.idle);
+  }
+  pthread_mutex_unlock(&marker.lock);
+  return NULL;
+}
+
+static void startMarkers() {
+  marker.workerCount = GC_MARK_THREADS;
+  if (marker.workerCount <= 0) {
+    marker.workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (marker.workerCount <= 0)
+      marker.workerCount = 1;
+  }
+
+  marker.workers = (MarkWorker *)malloc(sizeof(MarkWorker) * marker.workerCount);
+  if (marker.workers == NULL)
+    exit(1);
+  for (int i = 0; i < marker.workerCount; i++) {
+    initDeque(&marker.workers[i].deque);
+  }
+  marker.round = 0;
+
+  for (int i = 0; i < marker.workerCount; i++) {
+    MarkWorker *worker = &marker.workers[i];
+    if (pthread_create(&worker->thread, NULL, i == 0 ? runMarker : runHelper,
+                       worker) != 0)
+      exit(1);
+  }
+  marker.started = true;
+}
+
+// Blocks until the markers have run out of work, including anything that's
+// been handed to them.
+static void waitForMarkers() {
+  pthread_mutex_lock(&marker.lock);
+  if (marker.handoffCount > 0) {
+    marker.working = true;
+    pthread_cond_signal(&marker.wake);
+  }
+  while (marker.working) {
+    pthread_cond_wait(&marker.idle, &marker.lock);
+  }
+  pthread_mutex_unlock(&marker.lock);
+}
+
+static void stopMarkers() {
+  if (!marker.started)
+    return;
+  waitForMarkers();
+
+  pthread_mutex_lock(&marker.lock);
+  marker.quit = true;
+  pthread_cond_broadcast(&marker.wake);
+  pthread_cond_broadcast(&marker.roundStart);
+  pthread_mutex_unlock(&marker.lock);
+
+  for (int i = 0; i < marker.workerCount; i++) {
+    pthread_join(marker.workers[i].thread, NULL);
+    freeDeque(&marker.workers[i].deque);
+  }
+  free(marker.workers);
+  marker.workers = NULL;
+  marker.started = false;
+  marker.quit = false;
+
+  free(marker.handoff);
+  marker.handoff = NULL;
+  marker.handoffCapacity = 0;
+}
+#endif
+
+// Passes along everything the write barrier logged since the last safepoint.
+static void flushLog() {
+#ifdef GC_CONCURRENT_MARK
+  pthread_mutex_lock(&marker.lock);
+  for (int i = 0; i < vm.satbCount; i++) {
+    marker.handoff = pushObject(marker.handoff, &marker.handoffCount,
+                                &marker.handoffCapacity, vm.satbLog[i]);
+  }
+  pthread_mutex_unlock(&marker.lock);
+#else
+  for (int i = 0; i < vm.satbCount; i++) {
+    markObject(vm.satbLog[i]);
+  }
+#endif
+  vm.satbCount = 0;
+}
+
+static void startMarking() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
 #endif
-
+  // Marking works from a snapshot of whatever's reachable right now. Empty
+  // the nursery first, so that all of it is in the old generation.
+  minorCollection();
+  vm.gcPhase = GC_MARKING;
+  pacer.cycleStart = now();
+  pacer.pauseAtStart = vm.gcStats.totalPause;
   markRoots();
+
+#ifdef GC_CONCURRENT_MARK
+  pthread_mutex_lock(&marker.lock);
+  if (!marker.started) {
+    startMarkers();
+  }
+  marker.working = true;
+  pthread_cond_signal(&marker.wake);
+  pthread_mutex_unlock(&marker.lock);
+#endif
+}
+
+// Remembered objects that didn't get marked are about to be freed, so they
+// can't stay in the remembered set.
+static void forgetUnmarked() {
+  int count = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    if (isMarkedInPage(vm.remembered[i])) {
+      vm.remembered[count++] = vm.remembered[i];
+    }
+  }
+  vm.rememberedCount = count;
+}
+
+// The remark pause - the last of the marking, which happens all at once.
+// Only what the write barrier logged since the markers last checked is left,
+// and in a concurrent build they still handle that in parallel.
+static void finishMarking() {
+  flushLog();
+#ifdef GC_CONCURRENT_MARK
+  waitForMarkers();
+#else
   traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+#endif
+  forgetUnmarked();
+  freeDeferred();
+
+  // Every page is now out of date. They get swept lazily, when allocation
+  // reaches them, or a step at a time at safepoints. Allocation starts over
+  // from the first page, so the space freed up gets reused.
+  vm.gcPhase = GC_SWEEPING;
+  vm.sweepEpoch++;
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    SizeClass *sizeClass = &vm.sizeClasses[i];
+    sizeClass->allocating = sizeClass->pages;
+    sizeClass->sweeping = sizeClass->pages;
+  }
+}
+
+// Gives pages that ended up empty back to the system.
+static void releaseEmptyPages(SizeClass *sizeClass) {
+  Page **link = &sizeClass->pages;
+  sizeClass->tail = NULL;
+  while (*link != NULL) {
+    Page *page = *link;
+    if (page->liveCount == 0) {
+      *link = page->next;
+      freePage(page, freeOldObject);
+    } else {
+      sizeClass->tail = page;
+      link = &page->next;
+    }
+  }
+  sizeClass->allocating = sizeClass->pages;
+}
+
+#ifdef GC_COMPACT
+// A page that's less than a quarter full gets its objects moved out, so it
+// can be given back to the system.
+#define COMPACT_OCCUPANCY 4
+
+static bool isSparse(Page *page) {
+  return page->liveCount * COMPACT_OCCUPANCY < page->slotCount;
+}
+
+// Takes a size class's sparse pages out of its list, as long as their
+// objects fit in fewer pages than they're taking up now.
+static Page *takeSparsePages(SizeClass *sizeClass) {
+  uint32_t sparseCount = 0;
+  uint32_t liveCount = 0;
+  uint32_t freeCount = 0;
+  uint32_t slotCount = 0;
+  for (Page *page = sizeClass->pages; page != NULL; page = page->next) {
+    slotCount = page->slotCount;
+    if (isSparse(page)) {
+      sparseCount++;
+      liveCount += page->liveCount;
+    } else {
+      freeCount += page->slotCount - page->liveCount;
+    }
+  }
+
+  // Whatever doesn't fit in the other pages' free slots needs new pages
+  uint32_t needed = liveCount > freeCount
+                        ? (liveCount - freeCount + slotCount - 1) / slotCount
+                        : 0;
+  if (needed >= sparseCount)
+    return NULL;
+
+  Page *sparse = NULL;
+  Page **link = &sizeClass->pages;
+  sizeClass->tail = NULL;
+  while (*link != NULL) {
+    Page *page = *link;
+    if (isSparse(page)) {
+      *link = page->next;
+      page->next = sparse;
+      sparse = page;
+    } else {
+      sizeClass->tail = page;
+      link = &page->next;
+    }
+  }
+  sizeClass->allocating = sizeClass->pages;
+  return sparse;
+}
+
+static void evacuateObject(Obj *object) {
+  Obj *copy = moveObject(object);
+#ifdef DEBUG_LOG_GC
+  printf("%p evacuate to %p\n", (void *)object, (void *)copy);
+#else
+  (void)copy;
+#endif
+}
+
+// Moves the objects in sparse pages into denser ones, then rewrites every
+// reference to them, so the sparse pages can be freed.
+static void compactPages() {
+  Page *evacuated = NULL;
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    Page *page = takeSparsePages(&vm.sizeClasses[i]);
+    while (page != NULL) {
+      Page *next = page->next;
+      visitPage(page, evacuateObject);
+      page->next = evacuated;
+      evacuated = page;
+      page = next;
+    }
+  }
+  if (evacuated == NULL)
+    return;
+
+  compacting = true;
+  forwardRoots();
+  // The roots only include the globals when the write barrier asks for them
+  forwardTable(&vm.globals);
+  forwardTable(&vm.strings);
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    for (Page *page = vm.sizeClasses[i].pages; page != NULL;
+         page = page->next) {
+      visitPage(page, forwardReferences);
+    }
+  }
+  compacting = false;
+
+  int freed = 0;
+  while (evacuated != NULL) {
+    Page *next = evacuated->next;
+    vm.bytesAllocated -= (size_t)evacuated->liveCount * evacuated->slotSize;
+    freePage(evacuated, NULL);
+    evacuated = next;
+    freed++;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("-- compact: freed %d pages\n", freed);
+#else
+  (void)freed;
+#endif
+}
+
+// Copies a buffer into the new pool. The old pool gets freed wholesale, so
+// the original doesn't need freeing.
+static void *moveBuffer(void *pointer, size_t size) {
+  if (pointer == NULL || !isPooled(size))
+    return pointer;
+  void *copy = poolAllocate(&vm.buffers, size);
+  memcpy(copy, pointer, size);
+  return copy;
+}
+
+static void moveTableBuffer(Table *table) {
+  table->entries =
+      (Entry *)moveBuffer(table->entries, sizeof(Entry) * table->capacity);
+}
+
+static void moveBuffers(Obj *object) {
+  switch (object->type) {
+  case OBJ_CLASS:
+    moveTableBuffer(&((ObjClass *)object)->methods);
+    break;
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    closure->upvalues = (ObjUpvalue **)moveBuffer(
+        closure->upvalues, sizeof(ObjUpvalue *) * closure->upvalueCount);
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    Chunk *chunk = &function->chunk;
+    chunk->code = (uint8_t *)moveBuffer(chunk->code, chunk->capacity);
+    chunk->lines = (LineStart *)moveBuffer(
+        chunk->lines, sizeof(LineStart) * chunk->lineCapacity);
+    chunk->constants.values = (Value *)moveBuffer(
+        chunk->constants.values, sizeof(Value) * chunk->constants.capacity);
+    function->callSites = (CallSite *)moveBuffer(
+        function->callSites, sizeof(CallSite) * function->callSiteCount);
+    break;
+  }
+  case OBJ_INSTANCE:
+    moveTableBuffer(&((ObjInstance *)object)->fields);
+    break;
+  case OBJ_LIST: {
+    ValueArray *items = &((ObjList *)object)->items;
+    items->values =
+        (Value *)moveBuffer(items->values, sizeof(Value) * items->capacity);
+    break;
+  }
+  case OBJ_MAP: {
+    ValueTable *table = &((ObjMap *)object)->table;
+    table->entries = (ValueEntry *)moveBuffer(
+        table->entries, sizeof(ValueEntry) * table->capacity);
+    break;
+  }
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    string->chars = (char *)moveBuffer(string->chars, string->length + 1);
+    break;
+  }
+  case OBJ_BOUND_METHOD:
+  case OBJ_NATIVE:
+  case OBJ_UPVALUE:
+    break;
+  }
+}
+
+// The buffer pool can't give a chunk back until every block in it is free,
+// which may never happen. Once it's sparse enough, everything still in use
+// gets copied into a fresh pool instead, and the old one is freed.
+static void compactBuffers() {
+  BufferPool *pool = &vm.buffers;
+  if (pool->usedBytes * COMPACT_OCCUPANCY >=
+      (size_t)pool->chunkCount * POOL_CHUNK_SIZE)
+    return;
+
+  BufferPool old = *pool;
+  initPool(pool);
+  moveTableBuffer(&vm.globals);
+  moveTableBuffer(&vm.strings);
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    for (Page *page = vm.sizeClasses[i].pages; page != NULL;
+         page = page->next) {
+      visitPage(page, moveBuffers);
+    }
+  }
+  freePool(&old);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- compact: buffers down from %d chunks to %d\n", old.chunkCount,
+         pool->chunkCount);
+#endif
+}
+
+// Packs the old generation and the buffers its objects own into as little
+// memory as possible. Has to run between cycles, with nothing gray and
+// nobody else looking at the heap.
+static void compactHeap() {
+  // Young objects can point at anything that's about to move
+  minorCollection();
+  compactPages();
+  compactBuffers();
+
+#ifdef __GLIBC__
+  // Freed memory in the middle of malloc's heap stays resident unless it's
+  // asked to give it back
+  malloc_trim(0);
+#endif
+}
+#endif
+
+// Smooths a measurement into its running average.
+static double smooth(double average, double sample) {
+  return average == 0 ? sample : (average + sample) / 2;
+}
+
+// Decides when the next cycle starts. A cycle costs about the same however
+// long the program waits before the next one, so the longer it waits - the
+// more the heap grows in between - the smaller the fraction of its time it
+// spends collecting. The goal is the heap size that keeps that fraction on
+// target, given how fast the program allocates, and the next cycle starts
+// early enough to be done by the time the heap gets there.
+static void paceNextCycle() {
+  double time = now();
+  size_t allocated = pacer.allocated - pacer.allocatedAtLastEnd;
+  if (time > pacer.lastEnd) {
+    pacer.allocationRate =
+        smooth(pacer.allocationRate, allocated / (time - pacer.lastEnd));
+  }
+  pacer.cycleCost =
+      smooth(pacer.cycleCost, vm.gcStats.totalPause - pacer.pauseAtStart);
+  pacer.cycleDuration = smooth(pacer.cycleDuration, time - pacer.cycleStart);
+  pacer.lastEnd = time;
+  pacer.allocatedAtLastEnd = pacer.allocated;
+
+  GCConfig *config = &vm.gcConfig;
+  double live = (double)vm.bytesAllocated;
+  double growth = live * (config->growFactor - 1);
+  if (pacer.allocationRate > 0) {
+    growth = pacer.allocationRate * pacer.cycleCost / config->cpuFraction;
+    if (growth < live * GC_MIN_GROWTH) {
+      growth = live * GC_MIN_GROWTH;
+    }
+    if (growth > live * (config->growFactor - 1)) {
+      growth = live * (config->growFactor - 1);
+    }
+  }
+  double goal = live + growth;
+  if (goal < config->initialHeap) {
+    goal = config->initialHeap;
+  }
+
+  // Closing in on the soft limit, collect more often to stay under it, up
+  // to a point. If what's live won't fit anyway, the heap goes over, rather
+  // than the program grinding to a halt.
+  if (config->softLimit != 0 && goal > config->softLimit) {
+    double floor = live + pacer.allocationRate * pacer.cycleCost /
+                              GC_MAX_CPU_FRACTION;
+    goal = floor > config->softLimit ? floor : config->softLimit;
+  }
+  if (config->heapLimit != 0 && goal > config->heapLimit) {
+    goal = config->heapLimit;
+  }
+  pacer.goal = (size_t)goal;
+
+  // Start early enough to finish, going by how much the program allocated
+  // during the last cycle. It still gets at least half the growth first.
+  double trigger = goal - pacer.allocationRate * pacer.cycleDuration;
+  if (trigger < live + (goal - live) / 2) {
+    trigger = live + (goal - live) / 2;
+  }
+  vm.nextGC = (size_t)trigger;
+}
+
+static void finishSweeping() {
+  vm.gcPhase = GC_IDLE;
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    releaseEmptyPages(&vm.sizeClasses[i]);
+  }
+
+#if defined(GC_COMPACT) && defined(DEBUG_STRESS_GC)
+  // Move objects around as often as possible, so a reference that doesn't
+  // get fixed up shows itself
+  compactHeap();
+#endif
 
-  // Do a GC after the heap is twice as big as it is after this GC
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.gcStats.cycles++;
+  paceNextCycle();
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+  printf("   %zu bytes allocated, next at %zu\n", vm.bytesAllocated,
+         vm.nextGC);
+#endif
+}
+
+static void markStep(int budget) {
+  flushLog();
+
+#ifdef GC_CONCURRENT_MARK
+  // The marker thread does the actual work. All we do is check whether it's
+  // done.
+  pthread_mutex_lock(&marker.lock);
+  bool done = !marker.working;
+  pthread_mutex_unlock(&marker.lock);
+  if (done) {
+    finishMarking();
+  }
+#else
+  // Blacken gray objects until the budget runs out. Once there aren't any
+  // left, marking is done.
+  while (vm.grayCount > 0 && budget-- > 0) {
+    blackenObject(vm.grayStack[--vm.grayCount]);
+  }
+
+  if (vm.grayCount == 0) {
+    finishMarking();
+  }
 #endif
 }
 
+// Sweeps pages allocation hasn't gotten to yet, until the budget runs out.
+// Sweeping a page costs however many slots it has.
+static void sweepStep(int budget) {
+  bool done = true;
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    SizeClass *sizeClass = &vm.sizeClasses[i];
+    while (sizeClass->sweeping != NULL && budget > 0) {
+      Page *page = sizeClass->sweeping;
+      sizeClass->sweeping = page->next;
+      if (page->epoch != vm.sweepEpoch) {
+        sweepOldPage(page);
+        budget -= page->slotCount;
+      }
+    }
+    if (sizeClass->sweeping != NULL) {
+      done = false;
+    }
+  }
+
+  if (done) {
+    finishSweeping();
+  }
+}
+
+// Runs whatever's left of the current cycle without stopping.
+static void finishCycle() {
+  if (vm.gcPhase == GC_MARKING) {
+    finishMarking();
+  }
+  if (vm.gcPhase == GC_SWEEPING) {
+    sweepStep(INT_MAX);
+  }
+}
+
+// A full, stop-the-world collection. Any cycle that's already underway gets
+// finished first, since it may have missed objects that died after it
+// started. Builds with GC_COMPACT then move objects out of sparse pages.
+void collectGarbage() {
+  vm.gcStats.fullCollections++;
+  finishCycle();
+  startMarking();
+  finishCycle();
+#ifdef GC_COMPACT
+  compactHeap();
+#endif
+}
+
+static const char *typeNames[] = {
+    [OBJ_BOUND_METHOD] = "boundMethod", [OBJ_CLASS] = "class",
+    [OBJ_CLOSURE] = "closure",          [OBJ_FUNCTION] = "function",
+    [OBJ_INSTANCE] = "instance",        [OBJ_LIST] = "list",
+    [OBJ_MAP] = "map",                  [OBJ_NATIVE] = "native",
+    [OBJ_STRING] = "string",            [OBJ_UPVALUE] = "upvalue",
+};
+#define TYPE_COUNT (sizeof(typeNames) / sizeof(typeNames[0]))
+
+static size_t bytesByType[TYPE_COUNT];
+
+static void countObject(Obj *object) {
+  bytesByType[object->type] += objectSize(object->type);
+}
+
+// Appends to a buffer the way snprintf writes one, keeping track of how much
+// room is left.
+static void append(char *buffer, size_t size, size_t *length,
+                   const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t room = *length < size ? size - *length : 0;
+  int written = vsnprintf(buffer + *length, room, format, args);
+  va_end(args);
+  if (written > 0) {
+    *length += (size_t)written;
+  }
+}
+
+size_t formatGCStats(char *buffer, size_t size) {
+  // Objects the heap is holding on to. Outside of a full collection, that
+  // includes garbage that hasn't been found or swept yet.
+  for (size_t i = 0; i < TYPE_COUNT; i++) {
+    bytesByType[i] = 0;
+  }
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    for (Page *page = vm.sizeClasses[i].pages; page != NULL;
+         page = page->next) {
+      visitPage(page, countObject);
+    }
+  }
+  uint8_t *cursor = vm.nurseryStart;
+  while (cursor < vm.nurseryTop) {
+    Obj *young = (Obj *)cursor;
+    cursor += NURSERY_ALIGN(objectSize(young->type));
+    countObject(young);
+  }
+
+  GCStats *stats = &vm.gcStats;
+  size_t length = 0;
+  append(buffer, size, &length,
+         "{\"collections\":{\"minor\":%d,\"cycles\":%d,\"full\":%d},",
+         stats->minorCollections, stats->cycles, stats->fullCollections);
+  append(buffer, size, &length,
+         "\"pauses\":{\"total\":%.9f,\"max\":%.9f,\"histogram\":[",
+         stats->totalPause, stats->maxPause);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    append(buffer, size, &length, i == 0 ? "%d" : ",%d",
+           stats->pauseHistogram[i]);
+  }
+  append(buffer, size, &length,
+         "]},\"bytesFreed\":%zu,\"bytesPromoted\":%zu,"
+         "\"heapBytes\":%zu,\"nextGC\":%zu,\"liveBytesByType\":{",
+         stats->bytesFreed, stats->bytesPromoted, liveBytes(), vm.nextGC);
+  for (size_t i = 0; i < TYPE_COUNT; i++) {
+    append(buffer, size, &length, i == 0 ? "\"%s\":%zu" : ",\"%s\":%zu",
+           typeNames[i], bytesByType[i]);
+  }
+  append(buffer, size, &length,
+         "},\"pacer\":{\"allocationRate\":%.0f,\"cycleCost\":%.9f,"
+         "\"cycleDuration\":%.9f,\"goal\":%zu},",
+         pacer.allocationRate, pacer.cycleCost, pacer.cycleDuration,
+         pacer.goal);
+  append(buffer, size, &length,
+         "\"config\":{\"growFactor\":%g,\"initialHeap\":%zu,"
+         "\"cpuFraction\":%g,\"softLimit\":%zu,\"heapLimit\":%zu}}",
+         vm.gcConfig.growFactor, vm.gcConfig.initialHeap,
+         vm.gcConfig.cpuFraction, vm.gcConfig.softLimit,
+         vm.gcConfig.heapLimit);
+  return length;
+}
+
+size_t liveBytes() {
+  return vm.bytesAllocated + (size_t)(vm.nurseryTop - vm.nurseryStart);
+}
+
+// Zero where the kernel doesn't say.
+size_t residentBytes() {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file == NULL)
+    return 0;
+  unsigned long size;
+  unsigned long resident;
+  int read = fscanf(file, "%lu %lu", &size, &resident);
+  fclose(file);
+  if (read != 2)
+    return 0;
+  return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void recordPause(double pause) {
+  GCStats *stats = &vm.gcStats;
+  stats->totalPause += pause;
+  if (pause > stats->maxPause) {
+    stats->maxPause = pause;
+  }
+
+  int bucket = 0;
+  double bound = 1e-6;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= bound) {
+    bucket++;
+    bound *= 10;
+  }
+  stats->pauseHistogram[bucket]++;
+}
+
+// Called wherever every live object is reachable from the roots - between
+// instructions in the VM, and between declarations in the compiler. Returns
+// false if the heap is over its limit even after a full collection.
+bool gcSafepoint() {
+  double start = now();
+  vm.gcRequested = false;
+
+  if (vm.collectRequested) {
+    vm.collectRequested = false;
+    collectGarbage();
+  }
+
+#ifdef DEBUG_STRESS_GC
+  // Keep the collector permanently busy, so that every write barrier gets
+  // exercised
+  minorCollection();
+  if (vm.gcPhase == GC_IDLE) {
+    startMarking();
+  }
+#else
+  // Minor collections are cheap, so they run whenever the nursery fills up.
+  // A cycle in the old generation only starts once it's grown enough.
+  if (vm.nurseryFull) {
+    minorCollection();
+  }
+  if (vm.gcPhase == GC_IDLE && vm.bytesAllocated > vm.nextGC) {
+    startMarking();
+  }
+#endif
+
+  if (vm.gcPhase == GC_MARKING) {
+    markStep(GC_STEP_BUDGET);
+  } else if (vm.gcPhase == GC_SWEEPING) {
+    sweepStep(GC_STEP_BUDGET);
+  }
+
+  // Only give up on the heap limit once everything that can be freed has
+  // been
+  bool withinLimit = true;
+  if (vm.gcConfig.heapLimit != 0 && vm.bytesAllocated > vm.gcConfig.heapLimit) {
+    collectGarbage();
+    withinLimit = vm.bytesAllocated <= vm.gcConfig.heapLimit;
+  }
+
+  recordPause(now() - start);
+  return withinLimit;
+}
+
+void initHeap() {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    SizeClass *sizeClass = &vm.sizeClasses[i];
+    sizeClass->pages = NULL;
+    sizeClass->tail = NULL;
+    sizeClass->allocating = NULL;
+    sizeClass->sweeping = NULL;
+  }
+  initPool(&vm.buffers);
+  vm.sweepEpoch = 0;
+  vm.bytesAllocated = 0;
+  if (vm.gcConfig.growFactor <= 0) {
+    vm.gcConfig.growFactor = GC_HEAP_GROW_FACTOR;
+  }
+  if (vm.gcConfig.initialHeap == 0) {
+    vm.gcConfig.initialHeap = GC_INITIAL_HEAP;
+  }
+  if (vm.gcConfig.cpuFraction <= 0) {
+    vm.gcConfig.cpuFraction = GC_CPU_FRACTION;
+  }
+  memset(&pacer, 0, sizeof(pacer));
+  pacer.lastEnd = now();
+  vm.nextGC = vm.gcConfig.initialHeap;
+  vm.gcRequested = false;
+  vm.collectRequested = false;
+
+  vm.nurseryStart = (uint8_t *)malloc(NURSERY_SIZE);
+  if (vm.nurseryStart == NULL)
+    exit(1);
+  vm.nurseryTop = vm.nurseryStart;
+  vm.nurseryEnd = vm.nurseryStart + NURSERY_SIZE;
+  vm.nurseryFull = false;
+
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+  vm.globalsRemembered = false;
+
+  vm.promotedCount = 0;
+  vm.promotedCapacity = 0;
+  vm.promotedStack = NULL;
+
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+
+  vm.satbCount = 0;
+  vm.satbCapacity = 0;
+  vm.satbLog = NULL;
+
+  vm.deferredCount = 0;
+  vm.deferredCapacity = 0;
+  vm.deferredFrees = NULL;
+
+  vm.gcPhase = GC_IDLE;
+  memset(&vm.gcStats, 0, sizeof(GCStats));
+}
+
 // Free every object on the VM
 void freeObjects() {
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    Obj *next = object->next;
-    freeObject(object);
-    object = next;
+#ifdef GC_CONCURRENT_MARK
+  stopMarkers();
+#endif
+  freeDeferred();
+  vm.gcPhase = GC_IDLE;
+
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    Page *page = vm.sizeClasses[i].pages;
+    while (page != NULL) {
+      Page *next = page->next;
+      freePage(page, freeOldObject);
+      page = next;
+    }
   }
+
+  uint8_t *cursor = vm.nurseryStart;
+  while (cursor < vm.nurseryTop) {
+    Obj *young = (Obj *)cursor;
+    cursor += NURSERY_ALIGN(objectSize(young->type));
+    freeObjectContents(young);
+  }
+  free(vm.nurseryStart);
+
   free(vm.grayStack);
+  free(vm.promotedStack);
+  free(vm.remembered);
+  free(vm.satbLog);
+  free(vm.deferredFrees);
+  freePool(&vm.buffers);
 }
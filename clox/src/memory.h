@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count)                                                  \
   (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -18,10 +19,103 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// The marker gets its own thread, as long as values fit in a word. It reads
+// fields while the program is writing them, so it can't risk a torn value.
+#ifdef NAN_BOXING
+#define GC_CONCURRENT_MARK
+#endif
+
+// The size of the young generation. New objects are bump-allocated here, and
+// a minor collection copies the ones that survive into the old generation.
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// Buffers from reallocate can be moved when the pool gets compacted. These
+// never are, for memory that raw pointers lead into, but they still count
+// towards the heap.
+void *allocatePinned(size_t size);
+void freePinned(void *pointer, size_t size);
+void *allocateYoung(size_t size);
+Obj *allocateOld(size_t size);
 void markObject(Obj *object);
 void markValue(Value value);
+void rememberObject(Obj *object);
+void shadeObject(Obj *object);
+void retainInterned(ObjString *string);
+void markNewObject(Obj *object);
+Obj *forwardObject(Obj *object);
+Value forwardValue(Value value);
+bool gcSafepoint();
 void collectGarbage();
+// What the heap is holding on to, in bytes. Right after a full collection,
+// that's everything still live.
+size_t liveBytes();
+// How much of the process is actually resident in memory, in bytes.
+size_t residentBytes();
+// Writes the collector's statistics into the buffer as JSON, truncating them
+// like snprintf would. Returns how long they are in full.
+size_t formatGCStats(char *buffer, size_t size);
+void initHeap();
 void freeObjects();
 
+static inline bool isYoung(Obj *object) {
+  return (uint8_t *)object >= vm.nurseryStart &&
+         (uint8_t *)object < vm.nurseryEnd;
+}
+
+// Every store of a reference into an old object has to go through a write
+// barrier. If the stored value is young, the old object gets added to the
+// remembered set, so the next minor collection treats it as a root.
+static inline void writeBarrier(Obj *owner, Value value) {
+  if (IS_OBJ(value) && isYoung(AS_OBJ(value)) && !owner->isRemembered &&
+      !isYoung(owner)) {
+    rememberObject(owner);
+  }
+}
+
+// Marking works from a snapshot of the heap taken when it starts. While it's
+// running, a reference that's about to be overwritten in an old object gets
+// logged, so whatever was reachable through it still gets marked. Young
+// objects didn't exist when the snapshot was taken, so they're exempt.
+static inline void deletionBarrier(Obj *owner, Value old) {
+  if (vm.gcPhase == GC_MARKING && IS_OBJ(old) && !isYoung(owner)) {
+    shadeObject(AS_OBJ(old));
+  }
+}
+
+// Both barriers, for storing into one of an object's tables.
+static inline void writeBarrierTable(Obj *owner, Table *table, ObjString *key,
+                                     Value value) {
+  Value old;
+  if (vm.gcPhase == GC_MARKING && !isYoung(owner) &&
+      tableGet(table, key, &old)) {
+    deletionBarrier(owner, old);
+  }
+  writeBarrier(owner, OBJ_VAL(key));
+  writeBarrier(owner, value);
+}
+
+// The same for one of a map's tables, which can be keyed by any value.
+static inline void writeBarrierValueTable(Obj *owner, ValueTable *table,
+                                          Value key, Value value) {
+  Value old;
+  if (vm.gcPhase == GC_MARKING && !isYoung(owner) &&
+      valueTableGet(table, key, &old)) {
+    deletionBarrier(owner, old);
+  }
+  writeBarrier(owner, key);
+  writeBarrier(owner, value);
+}
+
+// The globals table isn't an object, but it's scanned the same way when a
+// young value gets stored in it. It's a root, so the marking snapshot
+// already covers whatever it held when marking started.
+static inline void writeBarrierGlobals(ObjString *name, Value value) {
+  if (isYoung((Obj *)name) || (IS_OBJ(value) && isYoung(AS_OBJ(value)))) {
+    vm.globalsRemembered = true;
+  }
+}
+
 #endif
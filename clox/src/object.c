@@ -12,12 +12,22 @@
   (type *)allocateObject(sizeof(type), objectType)
 
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  Obj *object = (Obj *)allocateYoung(size);
+  if (object == NULL) {
+    // The nursery is full until the next safepoint, so this one goes
+    // straight into the old generation
+    object = allocateOld(size);
+  }
   object->type = type;
   object->isMarked = false;
+  object->isRemembered = false;
+  if (!isYoung(object)) {
+    markNewObject(object);
+  }
 
-  object->next = vm.objects;
-  vm.objects = object;
+  // The caller is about to fill in its fields, and won't go through the
+  // write barrier to do it
+  rememberObject(object);
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void *)object, size, type);
@@ -56,7 +66,14 @@ ObjFunction *newFunction() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->slotCount = 0;
+  function->inlineKind = INLINE_NONE;
+  function->inlineOperand = 0;
   function->name = NULL;
+  function->callSites = NULL;
+  function->callSiteCount = 0;
+  function->decoded = NULL;
+  function->decodedCount = 0;
   initChunk(&function->chunk);
   return function;
 }
@@ -68,9 +85,28 @@ ObjInstance *newInstance(ObjClass *cls) {
   return instance;
 }
 
-ObjNative *newNative(NativeFn function) {
+ObjList *newList() {
+  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+void appendToList(ObjList *list, Value value) {
+  writeBarrier((Obj *)list, value);
+  writeValueArray(&list->items, value);
+}
+
+ObjMap *newMap() {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  initValueTable(&map->table);
+  return map;
+}
+
+ObjNative *newNative(NativeFn function, int arity, const char *name) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = arity;
+  native->name = name;
   return native;
 }
 
@@ -79,6 +115,7 @@ static ObjString *allocateString(char *chars, int length, uint32_t hash) {
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->intrinsic = -1;
 
   // tableSet can cause a gc, which would deallocate our newly made string.
   // We use the symbol stack to keep a reference to it temporarily.
@@ -103,6 +140,7 @@ ObjString *takeString(char *chars, int length) {
 
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
+    retainInterned(interned);
     return interned;
   }
 
@@ -112,8 +150,10 @@ ObjString *takeString(char *chars, int length) {
 ObjString *copyString(const char *chars, int length) {
   uint32_t hash = hashString(chars, length);
   ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-  if (interned != NULL)
+  if (interned != NULL) {
+    retainInterned(interned);
     return interned;
+  }
   char *heapChars = ALLOCATE(char, length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
@@ -128,6 +168,66 @@ ObjUpvalue *newUpvalue(Value *slot) {
   return upvalue;
 }
 
+// The lists and maps being printed right now, innermost last. One that holds
+// itself would otherwise print forever, so when it comes up again, or they
+// nest deeper than this, it's printed as [...] or {...} instead.
+#define PRINT_DEPTH_MAX 64
+static Obj *printing[PRINT_DEPTH_MAX];
+static int printingCount = 0;
+
+// Returns false if the object can't be printed in full here.
+static bool beginPrinting(Obj *object) {
+  if (printingCount == PRINT_DEPTH_MAX)
+    return false;
+  for (int i = 0; i < printingCount; i++) {
+    if (printing[i] == object)
+      return false;
+  }
+  printing[printingCount++] = object;
+  return true;
+}
+
+static void endPrinting() { printingCount--; }
+
+static void printList(ObjList *list) {
+  if (!beginPrinting((Obj *)list)) {
+    printf("[...]");
+    return;
+  }
+
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0)
+      printf(", ");
+    printValue(list->items.values[i]);
+  }
+  printf("]");
+  endPrinting();
+}
+
+static void printMap(ObjMap *map) {
+  if (!beginPrinting((Obj *)map)) {
+    printf("{...}");
+    return;
+  }
+
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->table.capacity; i++) {
+    ValueEntry *entry = &map->table.entries[i];
+    if (!isValueEntry(entry))
+      continue;
+    if (!first)
+      printf(", ");
+    first = false;
+    printValue(entry->key);
+    printf(": ");
+    printValue(entry->value);
+  }
+  printf("}");
+  endPrinting();
+}
+
 static void printFunction(ObjFunction *function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -153,6 +253,12 @@ void printObject(Value value) {
   case OBJ_INSTANCE:
     printf("%s instance", AS_INSTANCE(value)->cls->name->chars);
     break;
+  case OBJ_LIST:
+    printList(AS_LIST(value));
+    break;
+  case OBJ_MAP:
+    printMap(AS_MAP(value));
+    break;
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
@@ -5,6 +5,7 @@
 #include "common.h"
 #include "table.h"
 #include "value.h"
+#include "valuetable.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -13,6 +14,8 @@
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
@@ -21,7 +24,9 @@
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
@@ -31,30 +36,83 @@ typedef enum {
   OBJ_CLOSURE,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
+  OBJ_LIST,
+  OBJ_MAP,
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
 
+// The header every object starts with, packed into a few bytes. Mark bits
+// live in the object's page, and the heap gets walked a page at a time, so
+// there's no need for a mark or a list pointer here. isMarked is only set
+// once an object has moved - a young one copied into the old generation by a
+// minor collection, or an old one out of a sparse page by compaction - and
+// means the address of the copy has been written over its first fields.
 struct Obj {
-  ObjType type;
+  uint8_t type;
   bool isMarked;
-  struct Obj *next;
+  bool isRemembered;
 };
 
+// Some functions are simple enough that a call doesn't need a frame of its
+// own. The compiler spots them by their bytecode, and the VM works out what
+// they return in place of the call.
+typedef enum {
+  INLINE_NONE,
+  // Returns a constant, by its index in the pool.
+  INLINE_CONSTANT,
+  // Returns one of its arguments, or `this`, by its slot.
+  INLINE_ARGUMENT,
+  // Returns a field of `this`, named by a constant in the pool.
+  INLINE_FIELD,
+} InlineKind;
+
+// Remembers what an OP_INVOKE found the last time it ran, so the next call
+// on the same class can skip looking the method up. A call on another class
+// takes its place, until the site has missed too often to be worth caching.
+typedef struct {
+  struct ObjClass *cls;
+  struct ObjClosure *method;
+  int misses;
+} CallSite;
+
+// How many times a call site can see a different class before it stops
+// caching methods.
+#define MAX_SITE_MISSES 4
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // The most stack slots its locals take up at once.
+  int slotCount;
+  uint8_t inlineKind;
+  int inlineOperand;
   Chunk chunk;
   ObjString *name;
+  CallSite *callSites;
+  int callSiteCount;
+  // The chunk, decoded for the interpreter the first time the function is
+  // called. It's never moved, since frames and jumps point into it.
+  struct DecodedOp *decoded;
+  int decodedCount;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// Natives get their arguments in args, and put what they return in args[-1],
+// where the callee was. They return true, or nativeError() to throw an
+// exception instead.
+typedef bool (*NativeFn)(int argCount, Value *args);
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  // How many arguments it takes. Calls with any other number are a runtime
+  // error, like they are for functions.
+  int arity;
+  // For error messages. Natives are only ever defined from C, so their names
+  // are never collected.
+  const char *name;
 } ObjNative;
 
 struct ObjString {
@@ -62,6 +120,9 @@ struct ObjString {
   int length;
   char *chars;
   uint32_t hash;
+  // If this is the name of one of the intrinsics, which one, counting from
+  // OP_ABS. Otherwise -1.
+  int8_t intrinsic;
 };
 
 typedef struct ObjUpvalue {
@@ -77,7 +138,7 @@ typedef struct ObjUpvalue {
   struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction *function;
   // A pointer to an array of pointers to upvalues - hence the double pointer
@@ -85,7 +146,7 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+typedef struct ObjClass {
   Obj obj;
   ObjString *name;
   Table methods;
@@ -97,6 +158,18 @@ typedef struct {
   Table fields;
 } ObjInstance;
 
+// The elements live in one contiguous buffer, grown the same way as a
+// chunk's constants, so indexing is just an offset.
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+typedef struct {
+  Obj obj;
+  ValueTable table;
+} ObjMap;
+
 typedef struct {
   Obj obj;
   Value receiver;
@@ -108,7 +181,11 @@ ObjClass *newClass(ObjString *name);
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *cls);
-ObjNative *newNative(NativeFn function);
+ObjList *newList();
+// Adds a value to the end of a list, through the write barrier.
+void appendToList(ObjList *list, Value value);
+ObjMap *newMap();
+ObjNative *newNative(NativeFn function, int arity, const char *name);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
 ObjUpvalue *newUpvalue(Value *slot);
@@ -0,0 +1,853 @@
+#include "optimizer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+
+// Stands in for a handler or finally address that was never filled in.
+#define NO_TARGET -1
+
+// Jumps can be threaded through each other in a cycle, so the passes stop
+// after this many rounds even if they're still finding things to change.
+#define MAX_ROUNDS 8
+
+typedef struct {
+  uint8_t op;
+  int line;
+  // The operands, decoded to their full width whichever encoding they had.
+  // Jumps hold the index of the instruction they go to in the first one, and
+  // exception handlers hold them in the second and third. A closure has the
+  // number of variables it captures in the second, and an invocation has its
+  // call site in the third. A counted loop keeps the four bytes that come
+  // before its jump offset, as they were, in the second.
+  int operands[3];
+  // Where a closure's captured variables start in the function's list of
+  // them.
+  int captures;
+} Instruction;
+
+// One of the variables an OP_CLOSURE captures.
+typedef struct {
+  uint8_t isLocal;
+  int index;
+} Capture;
+
+typedef struct {
+  Chunk *chunk;
+  Instruction *code;
+  int count;
+  Capture *captures;
+  int captureCount;
+  // The instructions that start a basic block: the first one, any that can
+  // be jumped to, and any that follow a jump or a return.
+  bool *leaders;
+  bool *deleted;
+  // Scratch space, one entry per instruction and one past the end.
+  int *indexes;
+  bool *flags;
+} FunctionIR;
+
+static void *allocate(size_t size) {
+  void *pointer = malloc(size);
+  if (pointer == NULL)
+    exit(1);
+  return pointer;
+}
+
+// Reads an operand of the given width in bytes, most significant first.
+static uint32_t readOperand(Chunk *chunk, int offset, int width) {
+  uint32_t operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = operand << 8 | chunk->code[offset + i];
+  }
+  return operand;
+}
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE;
+}
+
+// Whether the instruction goes somewhere else in the first of its operands.
+// Counted loops do, but they aren't threaded or dropped like plain jumps,
+// since they do more than jump.
+static bool hasTarget(uint8_t op) {
+  return isJump(op) || op == OP_FOR_PREP || op == OP_FOR_LOOP;
+}
+
+// Whether execution never carries on to the next instruction.
+static bool endsBlock(uint8_t op) {
+  return op == OP_JUMP || op == OP_RETURN || op == OP_THROW ||
+         op == OP_PROPAGATE_EXCEPTION;
+}
+
+// Whether the instruction does nothing but push a value, so popping it right
+// away is the same as never running it.
+static bool onlyPushes(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_SMALL_INT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The instructions that take an index, which OP_WIDE makes two bytes.
+static bool isIndexed(uint8_t op) {
+  switch (op) {
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_CLASS:
+  case OP_METHOD:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Reads the chunk into instructions. Returns false if it has something the
+// optimizer doesn't understand, in which case the chunk is left as it was.
+static bool decode(FunctionIR *ir) {
+  Chunk *chunk = ir->chunk;
+  int *indexAt = ir->indexes;
+  for (int i = 0; i <= chunk->count; i++) {
+    indexAt[i] = -1;
+  }
+
+  int run = 0;
+  int offset = 0;
+  while (offset < chunk->count) {
+    Instruction *instruction = &ir->code[ir->count];
+    indexAt[offset] = ir->count++;
+    while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset)
+      run++;
+    instruction->line = chunk->lines[run].line;
+
+    int width = 1;
+    if (chunk->code[offset] == OP_WIDE) {
+      width = 2;
+      offset++;
+    }
+    instruction->op = chunk->code[offset++];
+    int *operands = instruction->operands;
+    switch (instruction->op) {
+    case OP_CONSTANT:
+      operands[0] = chunk->code[offset++];
+      break;
+    case OP_CONSTANT_LONG:
+      instruction->op = OP_CONSTANT;
+      operands[0] = readOperand(chunk, offset, 3);
+      offset += 3;
+      break;
+    case OP_SMALL_INT:
+    case OP_ADD_IMM:
+    case OP_SUBTRACT_IMM:
+    case OP_EQUAL_IMM:
+    case OP_GREATER_IMM:
+    case OP_LESS_IMM:
+      operands[0] = (int8_t)chunk->code[offset++];
+      break;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_BUILD_LIST:
+    case OP_STORE_LOCAL:
+      operands[0] = chunk->code[offset++];
+      break;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+    case OP_EQUAL_RR:
+    case OP_GREATER_RR:
+    case OP_LESS_RR:
+      operands[0] = chunk->code[offset];
+      operands[1] = chunk->code[offset + 1];
+      offset += 2;
+      break;
+    case OP_ADD_RI:
+    case OP_SUBTRACT_RI:
+    case OP_EQUAL_RI:
+    case OP_GREATER_RI:
+    case OP_LESS_RI:
+      operands[0] = chunk->code[offset];
+      operands[1] = (int8_t)chunk->code[offset + 1];
+      offset += 2;
+      break;
+    case OP_INVOKE:
+      operands[0] = readOperand(chunk, offset, width);
+      operands[1] = chunk->code[offset + width];
+      operands[2] = readOperand(chunk, offset + width + 1, width);
+      offset += width * 2 + 1;
+      break;
+    case OP_SUPER_INVOKE:
+      operands[0] = readOperand(chunk, offset, width);
+      operands[1] = chunk->code[offset + width];
+      offset += width + 1;
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      offset += width * 2;
+      operands[0] = offset + readOperand(chunk, offset - width * 2, width * 2);
+      break;
+    case OP_LOOP:
+      // Backward jumps are just jumps here. Lowering picks the opcode again.
+      instruction->op = OP_JUMP;
+      offset += width * 2;
+      operands[0] = offset - readOperand(chunk, offset - width * 2, width * 2);
+      break;
+    case OP_FOR_PREP:
+    case OP_FOR_LOOP: {
+      operands[1] = readOperand(chunk, offset, 4);
+      offset += 4 + width * 2;
+      int jump = readOperand(chunk, offset - width * 2, width * 2);
+      operands[0] = instruction->op == OP_FOR_PREP ? offset + jump
+                                                   : offset - jump;
+      break;
+    }
+    case OP_CLOSURE: {
+      operands[0] = readOperand(chunk, offset, width);
+      offset += width;
+      ObjFunction *function =
+          AS_FUNCTION(chunk->constants.values[operands[0]]);
+      operands[1] = function->upvalueCount;
+      instruction->captures = ir->captureCount;
+      for (int i = 0; i < function->upvalueCount; i++) {
+        Capture *capture = &ir->captures[ir->captureCount++];
+        capture->isLocal = chunk->code[offset];
+        capture->index = readOperand(chunk, offset + 1, width);
+        offset += 1 + width;
+      }
+      break;
+    }
+    case OP_PUSH_EXCEPTION_HANDLER: {
+      operands[0] = readOperand(chunk, offset, width);
+      offset += width;
+      uint32_t missing = width == 1 ? UINT16_MAX : UINT32_MAX;
+      for (int i = 1; i <= 2; i++) {
+        uint32_t address = readOperand(chunk, offset, width * 2);
+        operands[i] = address == missing ? NO_TARGET : (int)address;
+        offset += width * 2;
+      }
+      break;
+    }
+    default:
+      if (isIndexed(instruction->op)) {
+        operands[0] = readOperand(chunk, offset, width);
+        offset += width;
+      } else if (instruction->op > OP_PROPAGATE_EXCEPTION) {
+        return false;
+      }
+      break;
+    }
+  }
+  if (offset != chunk->count)
+    return false;
+  indexAt[offset] = ir->count;
+
+  // Now that every instruction has an index, jumps and handlers can point at
+  // them instead of at byte offsets.
+  for (int i = 0; i < ir->count; i++) {
+    Instruction *instruction = &ir->code[i];
+    int first = 0;
+    int last = -1;
+    if (hasTarget(instruction->op)) {
+      last = 0;
+    } else if (instruction->op == OP_PUSH_EXCEPTION_HANDLER) {
+      first = 1;
+      last = 2;
+    }
+    for (int j = first; j <= last; j++) {
+      int address = instruction->operands[j];
+      if (address == NO_TARGET)
+        continue;
+      if (address < 0 || address > chunk->count || indexAt[address] == -1)
+        return false;
+      instruction->operands[j] = indexAt[address];
+    }
+  }
+  return true;
+}
+
+static void findLeaders(FunctionIR *ir) {
+  memset(ir->leaders, 0, sizeof(bool) * (ir->count + 1));
+  ir->leaders[0] = true;
+  for (int i = 0; i < ir->count; i++) {
+    Instruction *instruction = &ir->code[i];
+    if (hasTarget(instruction->op)) {
+      ir->leaders[instruction->operands[0]] = true;
+      ir->leaders[i + 1] = true;
+    } else if (instruction->op == OP_PUSH_EXCEPTION_HANDLER) {
+      for (int j = 1; j <= 2; j++) {
+        if (instruction->operands[j] != NO_TARGET)
+          ir->leaders[instruction->operands[j]] = true;
+      }
+    } else if (endsBlock(instruction->op)) {
+      ir->leaders[i + 1] = true;
+    }
+  }
+}
+
+// Takes the deleted instructions out. Anything that pointed at one of them
+// points at whatever comes after it instead.
+static void compact(FunctionIR *ir) {
+  int *newIndex = ir->indexes;
+  int count = 0;
+  for (int i = 0; i < ir->count; i++) {
+    newIndex[i] = count;
+    if (!ir->deleted[i])
+      count++;
+  }
+  newIndex[ir->count] = count;
+
+  for (int i = 0; i < ir->count; i++) {
+    if (ir->deleted[i])
+      continue;
+    Instruction *instruction = &ir->code[newIndex[i]];
+    *instruction = ir->code[i];
+    if (hasTarget(instruction->op)) {
+      instruction->operands[0] = newIndex[instruction->operands[0]];
+    } else if (instruction->op == OP_PUSH_EXCEPTION_HANDLER) {
+      for (int j = 1; j <= 2; j++) {
+        if (instruction->operands[j] != NO_TARGET)
+          instruction->operands[j] = newIndex[instruction->operands[j]];
+      }
+    }
+  }
+  ir->count = count;
+  memset(ir->deleted, 0, sizeof(bool) * ir->count);
+}
+
+// A jump to another jump can go straight to where that one goes. So can a
+// conditional jump to another conditional jump, since neither pops the value
+// they test.
+static bool threadJumps(FunctionIR *ir) {
+  bool changed = false;
+  for (int i = 0; i < ir->count; i++) {
+    Instruction *instruction = &ir->code[i];
+    if (!isJump(instruction->op))
+      continue;
+
+    int target = instruction->operands[0];
+    for (int hops = 0; hops < ir->count && target < ir->count; hops++) {
+      Instruction *next = &ir->code[target];
+      if (next->op != OP_JUMP && (instruction->op != OP_JUMP_IF_FALSE ||
+                                  next->op != OP_JUMP_IF_FALSE)) {
+        break;
+      }
+      int through = next->operands[0];
+      // Conditional jumps only go forwards.
+      if (through == target ||
+          (instruction->op == OP_JUMP_IF_FALSE && through <= i)) {
+        break;
+      }
+      target = through;
+    }
+
+    if (target != instruction->operands[0]) {
+      instruction->operands[0] = target;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Gives the value the instruction pushes, if it's a constant.
+static bool constantValue(FunctionIR *ir, Instruction *instruction,
+                          Value *value) {
+  switch (instruction->op) {
+  case OP_NIL:
+    *value = NIL_VAL;
+    return true;
+  case OP_TRUE:
+    *value = BOOL_VAL(true);
+    return true;
+  case OP_FALSE:
+    *value = BOOL_VAL(false);
+    return true;
+  case OP_SMALL_INT:
+    *value = NUMBER_VAL(instruction->operands[0]);
+    return true;
+  case OP_CONSTANT:
+    *value = ir->chunk->constants.values[instruction->operands[0]];
+    return true;
+  default:
+    return false;
+  }
+}
+
+// A conditional jump on a constant always goes the same way. That's what
+// `while (true)` compiles to.
+static bool foldBranches(FunctionIR *ir) {
+  bool changed = false;
+  for (int i = 1; i < ir->count; i++) {
+    Value value;
+    if (ir->code[i].op != OP_JUMP_IF_FALSE || ir->leaders[i] ||
+        !constantValue(ir, &ir->code[i - 1], &value)) {
+      continue;
+    }
+
+    // The value stays on the stack either way, for whoever pops it next.
+    if (isFalsey(value)) {
+      ir->code[i].op = OP_JUMP;
+    } else {
+      ir->deleted[i] = true;
+    }
+    changed = true;
+  }
+  return changed;
+}
+
+// The instruction that loads the variable the given one stores.
+static uint8_t loadFor(uint8_t op) {
+  switch (op) {
+  case OP_SET_LOCAL:
+    return OP_GET_LOCAL;
+  case OP_SET_UPVALUE:
+    return OP_GET_UPVALUE;
+  case OP_SET_GLOBAL:
+    return OP_GET_GLOBAL;
+  default:
+    return OP_RETURN;
+  }
+}
+
+// Looks for short sequences within a block that can go.
+static bool peephole(FunctionIR *ir) {
+  bool changed = false;
+  for (int i = 0; i < ir->count; i++) {
+    Instruction *instruction = &ir->code[i];
+    if (isJump(instruction->op) && instruction->operands[0] == i + 1) {
+      // A jump to the next instruction.
+      ir->deleted[i] = true;
+      changed = true;
+      continue;
+    }
+    if (i + 1 >= ir->count || ir->leaders[i + 1] ||
+        ir->code[i + 1].op != OP_POP) {
+      continue;
+    }
+
+    if (onlyPushes(instruction->op)) {
+      // A value that's popped as soon as it's pushed.
+      ir->deleted[i] = true;
+      ir->deleted[i + 1] = true;
+      changed = true;
+      i++;
+    } else if (i + 2 < ir->count && !ir->leaders[i + 2] &&
+               ir->code[i + 2].op == loadFor(instruction->op) &&
+               ir->code[i + 2].operands[0] == instruction->operands[0]) {
+      // Storing a variable leaves its value on the stack, so there's no need
+      // to pop it and load it right back.
+      ir->deleted[i + 1] = true;
+      ir->deleted[i + 2] = true;
+      changed = true;
+      i += 2;
+    }
+  }
+  return changed;
+}
+
+// Deletes the blocks nothing can get to, like the code after a loop that
+// never ends.
+static bool removeUnreachable(FunctionIR *ir) {
+  bool *reached = ir->flags;
+  int *worklist = ir->indexes;
+  memset(reached, 0, sizeof(bool) * ir->count);
+  int pending = 0;
+  reached[0] = true;
+  worklist[pending++] = 0;
+
+#define VISIT(target)                                                          \
+  do {                                                                         \
+    int block = (target);                                                      \
+    if (block != NO_TARGET && block < ir->count && !reached[block]) {          \
+      reached[block] = true;                                                   \
+      worklist[pending++] = block;                                             \
+    }                                                                          \
+  } while (false)
+
+  while (pending > 0) {
+    for (int i = worklist[--pending]; i < ir->count; i++) {
+      Instruction *instruction = &ir->code[i];
+      if (hasTarget(instruction->op)) {
+        VISIT(instruction->operands[0]);
+      } else if (instruction->op == OP_PUSH_EXCEPTION_HANDLER) {
+        VISIT(instruction->operands[1]);
+        VISIT(instruction->operands[2]);
+      }
+      if (endsBlock(instruction->op))
+        break;
+      if (ir->leaders[i + 1]) {
+        VISIT(i + 1);
+        break;
+      }
+    }
+  }
+#undef VISIT
+
+  bool changed = false;
+  bool live = true;
+  for (int i = 0; i < ir->count; i++) {
+    if (ir->leaders[i])
+      live = reached[i];
+    if (!live) {
+      ir->deleted[i] = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// The register form of an operator, or OP_RETURN if it doesn't have one.
+static uint8_t registerForm(uint8_t op) {
+  switch (op) {
+  case OP_ADD:
+    return OP_ADD_RR;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_RR;
+  case OP_MULTIPLY:
+    return OP_MULTIPLY_RR;
+  case OP_DIVIDE:
+    return OP_DIVIDE_RR;
+  case OP_EQUAL:
+    return OP_EQUAL_RR;
+  case OP_GREATER:
+    return OP_GREATER_RR;
+  case OP_LESS:
+    return OP_LESS_RR;
+  case OP_ADD_IMM:
+    return OP_ADD_RI;
+  case OP_SUBTRACT_IMM:
+    return OP_SUBTRACT_RI;
+  case OP_EQUAL_IMM:
+    return OP_EQUAL_RI;
+  case OP_GREATER_IMM:
+    return OP_GREATER_RI;
+  case OP_LESS_IMM:
+    return OP_LESS_RI;
+  default:
+    return OP_RETURN;
+  }
+}
+
+static bool isNarrowLocal(Instruction *instruction, uint8_t op) {
+  return instruction->op == op && instruction->operands[0] <= UINT8_MAX;
+}
+
+// Folds the loads of locals that feed straight into an operator into the
+// operator itself, and stores that are popped straight away into a single
+// instruction. The register forms only have room for one-byte slots.
+static bool useRegisters(FunctionIR *ir) {
+  bool changed = false;
+  for (int i = 0; i + 1 < ir->count; i++) {
+    Instruction *instruction = &ir->code[i];
+    Instruction *next = &ir->code[i + 1];
+    if (ir->leaders[i + 1])
+      continue;
+
+    if (isNarrowLocal(instruction, OP_SET_LOCAL) && next->op == OP_POP) {
+      instruction->op = OP_STORE_LOCAL;
+      ir->deleted[i + 1] = true;
+      changed = true;
+      i++;
+      continue;
+    }
+    if (!isNarrowLocal(instruction, OP_GET_LOCAL))
+      continue;
+
+    uint8_t form = registerForm(next->op);
+    if (form != OP_RETURN && form >= OP_ADD_RI) {
+      // A local and an immediate. Errors come from the operator, so it's
+      // the operator's line that gets reported.
+      instruction->op = form;
+      instruction->line = next->line;
+      instruction->operands[1] = next->operands[0];
+      ir->deleted[i + 1] = true;
+      changed = true;
+      i++;
+    } else if (i + 2 < ir->count && !ir->leaders[i + 2] &&
+               isNarrowLocal(next, OP_GET_LOCAL) &&
+               (form = registerForm(ir->code[i + 2].op)) != OP_RETURN &&
+               form < OP_ADD_RI) {
+      // Two locals.
+      instruction->op = form;
+      instruction->line = ir->code[i + 2].line;
+      instruction->operands[1] = next->operands[0];
+      ir->deleted[i + 1] = true;
+      ir->deleted[i + 2] = true;
+      changed = true;
+      i += 2;
+    }
+  }
+  return changed;
+}
+
+static bool runPass(FunctionIR *ir, bool (*pass)(FunctionIR *)) {
+  findLeaders(ir);
+  bool changed = pass(ir);
+  compact(ir);
+  return changed;
+}
+
+// Whether the instruction's operands are too big for the narrow encoding,
+// leaving aside the jumps, which depend on where everything ends up.
+static bool needsWide(FunctionIR *ir, Instruction *instruction) {
+  switch (instruction->op) {
+  case OP_INVOKE:
+    return instruction->operands[0] > UINT8_MAX ||
+           instruction->operands[2] > UINT8_MAX;
+  case OP_SUPER_INVOKE:
+  case OP_PUSH_EXCEPTION_HANDLER:
+    return instruction->operands[0] > UINT8_MAX;
+  case OP_CLOSURE:
+    if (instruction->operands[0] > UINT8_MAX)
+      return true;
+    for (int i = 0; i < instruction->operands[1]; i++) {
+      if (ir->captures[instruction->captures + i].index > UINT8_MAX)
+        return true;
+    }
+    return false;
+  default:
+    return isIndexed(instruction->op) && instruction->operands[0] > UINT8_MAX;
+  }
+}
+
+static int encodedSize(Instruction *instruction, bool wide) {
+  switch (instruction->op) {
+  case OP_CONSTANT:
+    return instruction->operands[0] <= UINT8_MAX ? 2 : 4;
+  case OP_SMALL_INT:
+  case OP_ADD_IMM:
+  case OP_SUBTRACT_IMM:
+  case OP_EQUAL_IMM:
+  case OP_GREATER_IMM:
+  case OP_LESS_IMM:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_BUILD_LIST:
+  case OP_STORE_LOCAL:
+    return 2;
+  case OP_ADD_RR:
+  case OP_SUBTRACT_RR:
+  case OP_MULTIPLY_RR:
+  case OP_DIVIDE_RR:
+  case OP_EQUAL_RR:
+  case OP_GREATER_RR:
+  case OP_LESS_RR:
+  case OP_ADD_RI:
+  case OP_SUBTRACT_RI:
+  case OP_EQUAL_RI:
+  case OP_GREATER_RI:
+  case OP_LESS_RI:
+    return 3;
+  case OP_INVOKE:
+    return wide ? 7 : 4;
+  case OP_SUPER_INVOKE:
+    return wide ? 5 : 3;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+    return wide ? 6 : 3;
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP:
+    return wide ? 10 : 7;
+  case OP_CLOSURE:
+    return wide ? 4 + 3 * instruction->operands[1]
+                : 2 + 2 * instruction->operands[1];
+  case OP_PUSH_EXCEPTION_HANDLER:
+    return wide ? 12 : 6;
+  default:
+    return isIndexed(instruction->op) ? (wide ? 4 : 2) : 1;
+  }
+}
+
+static void writeOperand(Chunk *chunk, uint32_t operand, int width, int line) {
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+    writeChunk(chunk, (operand >> shift) & 0xff, line);
+  }
+}
+
+// Turns the instructions back into bytecode. Jumps start out narrow and are
+// widened as long as any of them can't reach.
+static void lower(FunctionIR *ir) {
+  bool *wide = ir->flags;
+  int *offsets = ir->indexes;
+  for (int i = 0; i < ir->count; i++) {
+    wide[i] = needsWide(ir, &ir->code[i]);
+  }
+
+  for (bool widened = true; widened;) {
+    offsets[0] = 0;
+    for (int i = 0; i < ir->count; i++) {
+      offsets[i + 1] = offsets[i] + encodedSize(&ir->code[i], wide[i]);
+    }
+
+    widened = false;
+    for (int i = 0; i < ir->count; i++) {
+      Instruction *instruction = &ir->code[i];
+      if (wide[i])
+        continue;
+      if (hasTarget(instruction->op)) {
+        int distance = offsets[instruction->operands[0]] - offsets[i + 1];
+        wide[i] = distance > UINT16_MAX || -distance > UINT16_MAX;
+      } else if (instruction->op == OP_PUSH_EXCEPTION_HANDLER) {
+        // 0xffff is the narrow stand-in for a missing address.
+        for (int j = 1; j <= 2; j++) {
+          int target = instruction->operands[j];
+          if (target != NO_TARGET && offsets[target] >= UINT16_MAX)
+            wide[i] = true;
+        }
+      }
+      widened |= wide[i];
+    }
+  }
+
+  Chunk *chunk = ir->chunk;
+  truncateChunk(chunk, 0);
+  for (int i = 0; i < ir->count; i++) {
+    Instruction *instruction = &ir->code[i];
+    int line = instruction->line;
+    int width = wide[i] ? 2 : 1;
+    uint8_t op = instruction->op;
+    int *operands = instruction->operands;
+
+    if (op == OP_JUMP && operands[0] <= i)
+      op = OP_LOOP;
+    if (op == OP_CONSTANT && operands[0] > UINT8_MAX)
+      op = OP_CONSTANT_LONG;
+    if (wide[i])
+      writeChunk(chunk, OP_WIDE, line);
+    writeChunk(chunk, op, line);
+
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_SMALL_INT:
+    case OP_ADD_IMM:
+    case OP_SUBTRACT_IMM:
+    case OP_EQUAL_IMM:
+    case OP_GREATER_IMM:
+    case OP_LESS_IMM:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_BUILD_LIST:
+    case OP_STORE_LOCAL:
+      writeChunk(chunk, (uint8_t)operands[0], line);
+      break;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+    case OP_EQUAL_RR:
+    case OP_GREATER_RR:
+    case OP_LESS_RR:
+    case OP_ADD_RI:
+    case OP_SUBTRACT_RI:
+    case OP_EQUAL_RI:
+    case OP_GREATER_RI:
+    case OP_LESS_RI:
+      writeChunk(chunk, (uint8_t)operands[0], line);
+      writeChunk(chunk, (uint8_t)operands[1], line);
+      break;
+    case OP_CONSTANT_LONG:
+      writeOperand(chunk, operands[0], 3, line);
+      break;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      writeOperand(chunk, operands[0], width, line);
+      writeChunk(chunk, (uint8_t)operands[1], line);
+      if (op == OP_INVOKE)
+        writeOperand(chunk, operands[2], width, line);
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      writeOperand(chunk, offsets[operands[0]] - offsets[i + 1], width * 2,
+                   line);
+      break;
+    case OP_LOOP:
+      writeOperand(chunk, offsets[i + 1] - offsets[operands[0]], width * 2,
+                   line);
+      break;
+    case OP_FOR_PREP:
+      writeOperand(chunk, operands[1], 4, line);
+      writeOperand(chunk, offsets[operands[0]] - offsets[i + 1], width * 2,
+                   line);
+      break;
+    case OP_FOR_LOOP:
+      writeOperand(chunk, operands[1], 4, line);
+      writeOperand(chunk, offsets[i + 1] - offsets[operands[0]], width * 2,
+                   line);
+      break;
+    case OP_CLOSURE:
+      writeOperand(chunk, operands[0], width, line);
+      for (int j = 0; j < operands[1]; j++) {
+        Capture *capture = &ir->captures[instruction->captures + j];
+        writeChunk(chunk, capture->isLocal, line);
+        writeOperand(chunk, capture->index, width, line);
+      }
+      break;
+    case OP_PUSH_EXCEPTION_HANDLER:
+      writeOperand(chunk, operands[0], width, line);
+      for (int j = 1; j <= 2; j++) {
+        uint32_t address = operands[j] == NO_TARGET
+                               ? UINT32_MAX
+                               : (uint32_t)offsets[operands[j]];
+        writeOperand(chunk, address, width * 2, line);
+      }
+      break;
+    default:
+      if (isIndexed(op))
+        writeOperand(chunk, operands[0], width, line);
+      break;
+    }
+  }
+}
+
+void optimizeChunk(Chunk *chunk, bool registers) {
+  // The compiler's own memory stays out of the collector's heap.
+  FunctionIR ir;
+  ir.chunk = chunk;
+  ir.code = allocate(sizeof(Instruction) * chunk->count);
+  ir.count = 0;
+  ir.captures = allocate(sizeof(Capture) * chunk->count);
+  ir.captureCount = 0;
+  ir.leaders = allocate(sizeof(bool) * (chunk->count + 1));
+  ir.deleted = calloc(chunk->count + 1, sizeof(bool));
+  ir.indexes = allocate(sizeof(int) * (chunk->count + 1));
+  ir.flags = allocate(sizeof(bool) * (chunk->count + 1));
+  if (ir.deleted == NULL)
+    exit(1);
+
+  if (decode(&ir)) {
+    bool changed = true;
+    for (int round = 0; changed && round < MAX_ROUNDS; round++) {
+      changed = runPass(&ir, threadJumps);
+      changed |= runPass(&ir, foldBranches);
+      changed |= runPass(&ir, peephole);
+      changed |= runPass(&ir, removeUnreachable);
+    }
+    if (registers)
+      runPass(&ir, useRegisters);
+    lower(&ir);
+  }
+
+  free(ir.code);
+  free(ir.captures);
+  free(ir.leaders);
+  free(ir.deleted);
+  free(ir.indexes);
+  free(ir.flags);
+}
@@ -0,0 +1,15 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// The compiler emits code in a single pass, as it parses, so it never gets to
+// look ahead. This goes back over a function's finished chunk as a graph of
+// basic blocks, simplifies it, and lowers it back to the same instructions.
+// It takes longer than the compiler alone, so it only runs when asked for.
+//
+// With registers, operators whose operands are locals get lowered to the
+// register forms that name them by slot, instead of pushing them first.
+void optimizeChunk(Chunk *chunk, bool registers);
+
+#endif
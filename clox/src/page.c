@@ -0,0 +1,102 @@
+#include "page.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Slots start after the header, rounded up to keep objects aligned.
+#define PAGE_HEADER_SIZE ((sizeof(Page) + 15) & ~(size_t)15)
+
+Page *newPage(uint32_t slotSize, uint32_t epoch) {
+  // Pages are aligned to their size, so any object can find its page by
+  // masking off the low bits of its address
+  void *memory;
+  if (posix_memalign(&memory, PAGE_SIZE, PAGE_SIZE) != 0)
+    exit(1);
+
+  Page *page = (Page *)memory;
+  page->next = NULL;
+  page->epoch = epoch;
+  page->slotSize = slotSize;
+  page->slotCount = (PAGE_SIZE - PAGE_HEADER_SIZE) / slotSize;
+  page->liveCount = 0;
+  page->slots = (uint8_t *)memory + PAGE_HEADER_SIZE;
+  memset(page->allocated, 0, sizeof(page->allocated));
+  memset(page->marked, 0, sizeof(page->marked));
+
+  // Build the free list back to front, so slots get handed out in address
+  // order
+  page->freeList = NULL;
+  for (int i = (int)page->slotCount - 1; i >= 0; i--) {
+    FreeSlot *slot = (FreeSlot *)(page->slots + (size_t)i * slotSize);
+    slot->next = page->freeList;
+    page->freeList = slot;
+  }
+  return page;
+}
+
+// Frees the page, along with whatever any object still in it owns. Pass NULL
+// if its objects have been moved elsewhere, and took what they own with them.
+void freePage(Page *page, FreeContentsFn freeContents) {
+  if (freeContents != NULL) {
+    memset(page->marked, 0, sizeof(page->marked));
+    sweepPage(page, page->epoch, freeContents);
+  }
+  free(page);
+}
+
+// Hands out a free slot, or NULL if the page is full.
+Obj *takeSlot(Page *page) {
+  FreeSlot *slot = page->freeList;
+  if (slot == NULL)
+    return NULL;
+  page->freeList = slot->next;
+
+  Obj *object = (Obj *)slot;
+  uint32_t index = slotIndex(page, object);
+  page->allocated[index / 64] |= (uint64_t)1 << (index % 64);
+  page->liveCount++;
+  return object;
+}
+
+// Frees every object that's allocated but not marked, and clears the mark
+// bits for the next cycle. Only the bitmaps and the dead objects get
+// touched. Returns how many objects were freed.
+int sweepPage(Page *page, uint32_t epoch, FreeContentsFn freeContents) {
+  int freed = 0;
+  int words = (int)(page->slotCount + 63) / 64;
+  for (int i = 0; i < words; i++) {
+    uint64_t dead = page->allocated[i] & ~page->marked[i];
+    while (dead != 0) {
+      int bit = __builtin_ctzll(dead);
+      dead &= dead - 1;
+
+      Obj *object =
+          (Obj *)(page->slots + (size_t)(i * 64 + bit) * page->slotSize);
+      freeContents(object);
+      FreeSlot *slot = (FreeSlot *)object;
+      slot->next = page->freeList;
+      page->freeList = slot;
+      freed++;
+    }
+
+    page->allocated[i] &= page->marked[i];
+    page->marked[i] = 0;
+  }
+
+  page->liveCount -= freed;
+  page->epoch = epoch;
+  return freed;
+}
+
+// Calls visit on every object allocated in the page.
+void visitPage(Page *page, VisitFn visit) {
+  int words = (int)(page->slotCount + 63) / 64;
+  for (int i = 0; i < words; i++) {
+    uint64_t allocated = page->allocated[i];
+    while (allocated != 0) {
+      int bit = __builtin_ctzll(allocated);
+      allocated &= allocated - 1;
+      visit((Obj *)(page->slots + (size_t)(i * 64 + bit) * page->slotSize));
+    }
+  }
+}
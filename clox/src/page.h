@@ -0,0 +1,86 @@
+#ifndef clox_page_h
+#define clox_page_h
+
+#include "common.h"
+#include "object.h"
+
+// Old objects live in aligned, fixed-size pages. Each page holds objects of
+// a single size class, and keeps their mark bits off to the side, in its
+// header, so marking and sweeping don't write to the objects themselves.
+#define PAGE_SIZE (64 * 1024)
+
+// Size classes go up in steps of this many bytes. Every kind of object is
+// well under the largest one.
+#define SIZE_CLASS_STEP 8
+#define SIZE_CLASS_MAX 256
+#define SIZE_CLASS_COUNT (SIZE_CLASS_MAX / SIZE_CLASS_STEP + 1)
+#define SIZE_CLASS(size) (((size) + SIZE_CLASS_STEP - 1) / SIZE_CLASS_STEP)
+
+// Enough bits for a page full of the smallest size class.
+#define PAGE_BITMAP_WORDS (PAGE_SIZE / SIZE_CLASS_STEP / 64)
+
+// A slot that's free holds the next free slot in its page.
+typedef struct FreeSlot {
+  struct FreeSlot *next;
+} FreeSlot;
+
+typedef struct Page {
+  struct Page *next;
+  // The cycle this page was last swept in. Pages from an older one still
+  // hold that cycle's dead objects.
+  uint32_t epoch;
+  uint32_t slotSize;
+  uint32_t slotCount;
+  uint32_t liveCount;
+  // The free slots, threaded through the slots themselves.
+  FreeSlot *freeList;
+  uint8_t *slots;
+  uint64_t allocated[PAGE_BITMAP_WORDS];
+  uint64_t marked[PAGE_BITMAP_WORDS];
+} Page;
+
+// The pages for one size class. Allocation works its way along the list,
+// sweeping pages the current cycle hasn't gotten to yet as it goes.
+typedef struct {
+  Page *pages;
+  Page *tail;
+  Page *allocating;
+  Page *sweeping;
+} SizeClass;
+
+typedef void (*FreeContentsFn)(Obj *object);
+typedef void (*VisitFn)(Obj *object);
+
+Page *newPage(uint32_t slotSize, uint32_t epoch);
+void freePage(Page *page, FreeContentsFn freeContents);
+Obj *takeSlot(Page *page);
+int sweepPage(Page *page, uint32_t epoch, FreeContentsFn freeContents);
+void visitPage(Page *page, VisitFn visit);
+
+static inline Page *pageOf(Obj *object) {
+  return (Page *)((uintptr_t)object & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static inline uint32_t slotIndex(Page *page, Obj *object) {
+  return (uint32_t)(((uint8_t *)object - page->slots) / page->slotSize);
+}
+
+static inline bool isMarkedInPage(Obj *object) {
+  Page *page = pageOf(object);
+  uint32_t index = slotIndex(page, object);
+  uint64_t word = __atomic_load_n(&page->marked[index / 64], __ATOMIC_RELAXED);
+  return (word >> (index % 64)) & 1;
+}
+
+// Sets an object's mark bit, returning false if it was already set. Marker
+// threads can race each other here, so only one of them wins.
+static inline bool markInPage(Obj *object) {
+  Page *page = pageOf(object);
+  uint32_t index = slotIndex(page, object);
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  uint64_t word = __atomic_fetch_or(&page->marked[index / 64], bit,
+                                    __ATOMIC_RELAXED);
+  return (word & bit) == 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include "pool.h"
+
+#include <stdlib.h>
+
+// Blocks start after the chunk's header, rounded up to keep them aligned.
+#define POOL_HEADER_SIZE ((sizeof(PoolChunk) + 15) & ~(size_t)15)
+
+void initPool(BufferPool *pool) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    pool->freeLists[i] = NULL;
+  }
+  pool->chunks = NULL;
+  pool->chunkCount = 0;
+  pool->usedBytes = 0;
+}
+
+void freePool(BufferPool *pool) {
+  PoolChunk *chunk = pool->chunks;
+  while (chunk != NULL) {
+    PoolChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  initPool(pool);
+}
+
+// Carves a fresh chunk into blocks of one size class.
+static void refill(BufferPool *pool, int sizeClass) {
+  PoolChunk *chunk = (PoolChunk *)malloc(POOL_CHUNK_SIZE);
+  if (chunk == NULL)
+    exit(1);
+  chunk->next = pool->chunks;
+  pool->chunks = chunk;
+  pool->chunkCount++;
+
+  size_t blockSize = (size_t)(sizeClass + 1) * POOL_STEP;
+  size_t blockCount = (POOL_CHUNK_SIZE - POOL_HEADER_SIZE) / blockSize;
+  uint8_t *blocks = (uint8_t *)chunk + POOL_HEADER_SIZE;
+
+  // Build the free list back to front, so blocks get handed out in address
+  // order
+  for (size_t i = blockCount; i > 0; i--) {
+    PoolBlock *block = (PoolBlock *)(blocks + (i - 1) * blockSize);
+    block->next = pool->freeLists[sizeClass];
+    pool->freeLists[sizeClass] = block;
+  }
+}
+
+void *poolAllocate(BufferPool *pool, size_t size) {
+  int sizeClass = POOL_CLASS(size);
+  if (pool->freeLists[sizeClass] == NULL) {
+    refill(pool, sizeClass);
+  }
+
+  PoolBlock *block = pool->freeLists[sizeClass];
+  pool->freeLists[sizeClass] = block->next;
+  pool->usedBytes += (size_t)(sizeClass + 1) * POOL_STEP;
+  return block;
+}
+
+// The caller has to pass the same size the block was allocated with - it's
+// the only way to tell which free list it goes back on.
+void poolFree(BufferPool *pool, void *pointer, size_t size) {
+  int sizeClass = POOL_CLASS(size);
+  PoolBlock *block = (PoolBlock *)pointer;
+  block->next = pool->freeLists[sizeClass];
+  pool->freeLists[sizeClass] = block;
+  pool->usedBytes -= (size_t)(sizeClass + 1) * POOL_STEP;
+}
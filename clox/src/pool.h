@@ -0,0 +1,50 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common.h"
+
+// Objects have the nursery and the old generation's pages, but the buffers
+// they own - string characters, upvalue arrays, the entries of small tables -
+// come and go just as often. Small ones are handed out from free lists, one
+// per size class, instead of going through malloc every time.
+#define POOL_STEP 16
+#define POOL_MAX 256
+#define POOL_CLASS_COUNT (POOL_MAX / POOL_STEP)
+#define POOL_CLASS(size) (((size) - 1) / POOL_STEP)
+
+// Free lists are refilled a chunk at a time.
+#define POOL_CHUNK_SIZE (16 * 1024)
+
+typedef struct PoolBlock {
+  struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct PoolChunk {
+  struct PoolChunk *next;
+} PoolChunk;
+
+typedef struct {
+  PoolBlock *freeLists[POOL_CLASS_COUNT];
+  // Every chunk the pool has carved up. Blocks go back on their free list
+  // when they're freed, so these are only released along with the pool.
+  PoolChunk *chunks;
+  int chunkCount;
+  // Bytes in blocks that have been handed out and not freed yet.
+  size_t usedBytes;
+} BufferPool;
+
+void initPool(BufferPool *pool);
+void freePool(BufferPool *pool);
+void *poolAllocate(BufferPool *pool, size_t size);
+void poolFree(BufferPool *pool, void *pointer, size_t size);
+
+static inline bool isPooled(size_t size) {
+  return size > 0 && size <= POOL_MAX;
+}
+
+// The size a buffer really takes up.
+static inline size_t pooledSize(size_t size) {
+  return isPooled(size) ? (POOL_CLASS(size) + 1) * POOL_STEP : size;
+}
+
+#endif
@@ -76,8 +76,10 @@ static void adjustCapacity(Table *table, int capacity) {
 
   FREE_ARRAY(Entry, table->entries, table->capacity);
 
+  // The marker thread may be reading this table. Publishing the capacity
+  // last means it never sees the bigger capacity with the old entries.
   table->entries = entries;
-  table->capacity = capacity;
+  __atomic_store_n(&table->capacity, capacity, __ATOMIC_RELEASE);
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
@@ -142,24 +144,83 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
   }
 }
 
-// Interned strings get marked by virtue of being reached through other
-// objects. Now we need to remove strings that got marked. This means that
-// the strings table is *basically* a WeakMap.
-void tableRemoveWhite(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    // Remember, we're using the table as a *set* here!
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+// Deletes a key without leaving a tombstone behind, by shifting the entries
+// after it back into the hole. Only for tables that never get tombstones -
+// the intern table, where strings are deleted as they die, so it would
+// otherwise fill up with them.
+bool tableRemoveKey(Table *table, ObjString *key) {
+  if (table->count == 0)
+    return false;
+
+  uint32_t mask = table->capacity - 1;
+  uint32_t hole = key->hash & mask;
+  for (;;) {
+    Entry *entry = &table->entries[hole];
+    if (entry->key == NULL)
+      return false;
+    if (entry->key == key)
+      break;
+    hole = (hole + 1) & mask;
+  }
+
+  // An entry further along the run can fill the hole, as long as that
+  // doesn't put it before the slot it hashes to
+  uint32_t index = (hole + 1) & mask;
+  for (;;) {
+    Entry *entry = &table->entries[index];
+    if (entry->key == NULL)
+      break;
+    uint32_t home = entry->key->hash & mask;
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      table->entries[hole] = *entry;
+      hole = index;
+    }
+    index = (index + 1) & mask;
+  }
+
+  table->entries[hole].key = NULL;
+  table->entries[hole].value = NIL_VAL;
+  table->count--;
+  return true;
+}
+
+// Swaps a key for a different object with the same contents - a minor
+// collection uses this when an interned string gets promoted. By then, the
+// forwarding address has been written over the old key's fields, so the
+// search goes by the replacement's hash, which is the same.
+void tableReplaceKey(Table *table, ObjString *key, ObjString *replacement) {
+  if (table->count == 0)
+    return;
+
+  uint32_t index = replacement->hash & (table->capacity - 1);
+  for (;;) {
+    Entry *entry = &table->entries[index];
+    if (entry->key == key) {
+      entry->key = replacement;
+      return;
     }
+    if (entry->key == NULL && IS_NIL(entry->value))
+      return;
+    index = (index + 1) & (table->capacity - 1);
   }
 }
 
 void markTable(Table *table) {
   // Mark all keys and values in the table - remember, keys are string objects
-  for (int i = 0; i < table->capacity; i++) {
+  int capacity = __atomic_load_n(&table->capacity, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < capacity; i++) {
     Entry *entry = &table->entries[i];
     markObject((Obj *)entry->key);
     markValue(entry->value);
   }
 }
+
+void forwardTable(Table *table) {
+  // Like markTable, but updating keys and values that were in the nursery.
+  // The hash lives in the string, so moving a key doesn't move its entry.
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    entry->key = (ObjString *)forwardObject((Obj *)entry->key);
+    entry->value = forwardValue(entry->value);
+  }
+}
@@ -20,10 +20,12 @@ void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
+bool tableRemoveKey(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash);
-void tableRemoveWhite(Table *table);
+void tableReplaceKey(Table *table, ObjString *key, ObjString *replacement);
 void markTable(Table *table);
+void forwardTable(Table *table);
 
 #endif
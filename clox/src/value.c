@@ -21,7 +21,9 @@ void writeValueArray(ValueArray *array, Value value) {
   }
 
   array->values[array->count] = value;
-  array->count++;
+  // The marker thread may be reading this array, so only bump the count once
+  // the value is in place
+  __atomic_store_n(&array->count, array->count + 1, __ATOMIC_RELEASE);
 }
 
 void freeValueArray(ValueArray *array) {
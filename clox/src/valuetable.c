@@ -0,0 +1,189 @@
+#include "valuetable.h"
+
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#define TABLE_MAX_LOAD 0.75
+
+// No value is ever an object at NULL, so that marks a slot with no key. With
+// a nil value it's empty, and with true it's a tombstone.
+#define NO_KEY OBJ_VAL(NULL)
+
+static bool isNoKey(Value key) { return IS_OBJ(key) && AS_OBJ(key) == NULL; }
+
+bool isValueEntry(ValueEntry *entry) { return !isNoKey(entry->key); }
+
+void initValueTable(ValueTable *table) {
+  table->count = 0;
+  table->size = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+  table->needsRehash = false;
+}
+
+void freeValueTable(ValueTable *table) {
+  FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+  initValueTable(table);
+}
+
+static uint32_t hashValue(Value value) {
+  // Strings carry their hash with them, wherever they get moved to
+  if (IS_STRING(value))
+    return AS_STRING(value)->hash;
+
+  uint64_t bits;
+  if (IS_OBJ(value)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  } else if (IS_NUMBER(value)) {
+    // -0 equals 0, so it has to hash the same
+    double number = AS_NUMBER(value);
+    if (number == 0)
+      number = 0;
+    memcpy(&bits, &number, sizeof(bits));
+  } else if (IS_BOOL(value)) {
+    bits = AS_BOOL(value) ? 1 : 2;
+  } else {
+    bits = 3;
+  }
+
+  // The finalizer from MurmurHash3, so that addresses and small integers,
+  // which only differ in a few bits, spread across the whole table
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static ValueEntry *findEntry(ValueEntry *entries, int capacity, Value key) {
+  uint32_t index = hashValue(key) & (capacity - 1);
+  ValueEntry *tombstone = NULL;
+
+  for (;;) {
+    ValueEntry *entry = &entries[index];
+    if (isNoKey(entry->key)) {
+      if (IS_NIL(entry->value)) {
+        // Empty entry.
+        return tombstone != NULL ? tombstone : entry;
+      } else {
+        // We found a tombstone.
+        if (tombstone == NULL)
+          tombstone = entry;
+      }
+    } else if (valuesEqual(entry->key, key)) {
+      // We found the key.
+      return entry;
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void adjustCapacity(ValueTable *table, int capacity) {
+  ValueEntry *entries = ALLOCATE(ValueEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NO_KEY;
+    entries[i].value = NIL_VAL;
+  }
+
+  table->count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    ValueEntry *entry = &table->entries[i];
+    if (isNoKey(entry->key))
+      continue;
+
+    ValueEntry *dest = findEntry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    table->count++;
+  }
+
+  FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+  table->size = table->count;
+
+  // Same as Table - the marker may be reading it, so the capacity goes last
+  table->entries = entries;
+  __atomic_store_n(&table->capacity, capacity, __ATOMIC_RELEASE);
+  table->needsRehash = false;
+}
+
+// Puts every entry back where its key hashes to now, if a collection has
+// moved any of them.
+static void prepareTable(ValueTable *table) {
+  if (table->needsRehash) {
+    adjustCapacity(table, table->capacity);
+  }
+}
+
+bool valueTableGet(ValueTable *table, Value key, Value *value) {
+  if (table->count == 0)
+    return false;
+  prepareTable(table);
+  ValueEntry *entry = findEntry(table->entries, table->capacity, key);
+  if (isNoKey(entry->key))
+    return false;
+
+  *value = entry->value;
+  return true;
+}
+
+bool valueTableSet(ValueTable *table, Value key, Value value) {
+  prepareTable(table);
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    adjustCapacity(table, capacity);
+  }
+
+  ValueEntry *entry = findEntry(table->entries, table->capacity, key);
+  bool isNewKey = isNoKey(entry->key);
+  if (isNewKey && IS_NIL(entry->value))
+    table->count++;
+  if (isNewKey)
+    table->size++;
+
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+bool valueTableDelete(ValueTable *table, Value key) {
+  if (table->count == 0)
+    return false;
+  prepareTable(table);
+
+  // Find the entry.
+  ValueEntry *entry = findEntry(table->entries, table->capacity, key);
+  if (isNoKey(entry->key))
+    return false;
+
+  // Place a tombstone in the entry.
+  entry->key = NO_KEY;
+  entry->value = BOOL_VAL(true);
+  table->size--;
+  return true;
+}
+
+void markValueTable(ValueTable *table) {
+  int capacity = __atomic_load_n(&table->capacity, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < capacity; i++) {
+    ValueEntry *entry = &table->entries[i];
+    markValue(entry->key);
+    markValue(entry->value);
+  }
+}
+
+void forwardValueTable(ValueTable *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    ValueEntry *entry = &table->entries[i];
+    Value key = forwardValue(entry->key);
+    if (IS_OBJ(key) && AS_OBJ(key) != AS_OBJ(entry->key) && !IS_STRING(key)) {
+      table->needsRehash = true;
+    }
+    entry->key = key;
+    entry->value = forwardValue(entry->value);
+  }
+}
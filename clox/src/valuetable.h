@@ -0,0 +1,39 @@
+#ifndef clox_valuetable_h
+#define clox_valuetable_h
+
+#include "common.h"
+#include "value.h"
+
+// A hash table like Table, but keyed by any value rather than just strings.
+// Keys are equal when valuesEqual says so - numbers by value, and objects by
+// identity, which for strings is the same as by contents since they're
+// interned.
+typedef struct {
+  Value key;
+  Value value;
+} ValueEntry;
+
+typedef struct {
+  // Like Table, the count includes tombstones, since they fill up the table
+  // just the same. The size is how many keys there really are.
+  int count;
+  int size;
+  int capacity;
+  ValueEntry *entries;
+  // Objects other than strings hash by address, so a collection that moves
+  // one of the keys leaves its entry in the wrong place. The table gets
+  // rehashed before it's next searched.
+  bool needsRehash;
+} ValueTable;
+
+void initValueTable(ValueTable *table);
+void freeValueTable(ValueTable *table);
+bool valueTableGet(ValueTable *table, Value key, Value *value);
+bool valueTableSet(ValueTable *table, Value key, Value value);
+bool valueTableDelete(ValueTable *table, Value key);
+// Whether an entry holds a key, rather than being empty or a tombstone.
+bool isValueEntry(ValueEntry *entry);
+void markValueTable(ValueTable *table);
+void forwardValueTable(ValueTable *table);
+
+#endif
@@ -1,5 +1,6 @@
 #include "vm.h"
 
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,13 +9,53 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "decoder.h"
+#include "listlib.h"
+#include "maplib.h"
+#include "mathlib.h"
 #include "memory.h"
 #include "object.h"
 
 VM vm;
 
-static Value clockNative(int argCount, Value *args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(int argCount, Value *args) {
+  args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+// The longest the garbage collector has paused the program for, in seconds.
+static bool gcMaxPauseNative(int argCount, Value *args) {
+  args[-1] = NUMBER_VAL(vm.gcStats.maxPause);
+  return true;
+}
+
+// Asks for a full collection, which happens as soon as this native returns.
+static bool gcCollectNative(int argCount, Value *args) {
+  vm.collectRequested = true;
+  vm.gcRequested = true;
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+static bool gcLiveBytesNative(int argCount, Value *args) {
+  args[-1] = NUMBER_VAL((double)liveBytes());
+  return true;
+}
+
+static bool gcResidentBytesNative(int argCount, Value *args) {
+  args[-1] = NUMBER_VAL((double)residentBytes());
+  return true;
+}
+
+// Everything the collector keeps track of, as a JSON string.
+static bool gcStatsNative(int argCount, Value *args) {
+  char buffer[1024];
+  size_t length = formatGCStats(buffer, sizeof(buffer));
+  if (length >= sizeof(buffer)) {
+    length = sizeof(buffer) - 1;
+  }
+  args[-1] = OBJ_VAL(copyString(buffer, (int)length));
+  return true;
 }
 
 static void resetStack() {
@@ -23,6 +64,16 @@ static void resetStack() {
   vm.openUpvalues = NULL;
 }
 
+// The line of the instruction a frame is running, or of the call it's
+// waiting on.
+static int frameLine(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  uint32_t offset = 0;
+  if (frame->ip != NULL && frame->ip > function->decoded)
+    offset = frame->ip[-1].offset;
+  return getLine(&function->chunk, (int)offset);
+}
+
 static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -34,8 +85,7 @@ static void runtimeError(const char *format, ...) {
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame *frame = &vm.frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in ", frameLine(frame));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -46,9 +96,10 @@ static void runtimeError(const char *format, ...) {
   resetStack();
 }
 
-static void defineNative(const char *name, NativeFn function) {
+void defineNative(const char *name, NativeFn function, int arity) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
+  push(OBJ_VAL(newNative(function, arity, name)));
+  writeBarrierGlobals(AS_STRING(vm.stack[0]), vm.stack[1]);
   tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
   pop();
   pop();
@@ -56,21 +107,24 @@ static void defineNative(const char *name, NativeFn function) {
 
 void initVM() {
   resetStack();
-  vm.objects = NULL;
-  vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
-
-  vm.grayCount = 0;
-  vm.grayCapacity = 0;
-  vm.grayStack = NULL;
+  initHeap();
 
   initTable(&vm.globals);
   initTable(&vm.strings);
 
   vm.initString = NULL;
+  vm.redefinedIntrinsics = 0;
   vm.initString = copyString("init", 4);
 
-  defineNative("clock", clockNative);
+  defineNative("clock", clockNative, 0);
+  defineNative("gcMaxPause", gcMaxPauseNative, 0);
+  defineNative("gcCollect", gcCollectNative, 0);
+  defineNative("gcLiveBytes", gcLiveBytesNative, 0);
+  defineNative("gcResidentBytes", gcResidentBytesNative, 0);
+  defineNative("gcStats", gcStatsNative, 0);
+  defineMathNatives();
+  defineListNatives();
+  defineMapNatives();
 }
 
 void freeVM() {
@@ -102,13 +156,14 @@ static Value getStackTrace(void) {
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame *frame = &vm.frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    uint32_t lineno = function->chunk.lines[instruction];
+    uint32_t lineno = frameLine(frame);
     index += snprintf(
         &stacktrace[index], MAX_LINE_LENGTH, "[line %d] in %s()\n", lineno,
         function->name == NULL ? "script" : function->name->chars);
   }
-  stacktrace = GROW_ARRAY(char, stacktrace, maxStackTraceLength, index);
+  // Keep room for the terminator, which takeString expects
+  stacktrace = GROW_ARRAY(char, stacktrace, maxStackTraceLength, index + 1);
+  stacktrace[index] = '\0';
   return OBJ_VAL(takeString(stacktrace, index));
 #undef MAX_LINE_LENGTH
 }
@@ -132,8 +187,19 @@ bool instanceof (ObjInstance * instance, Value cls) {
 // exception handling code to understand the differences.
 //
 // Returns true if the error was handled.
+static void closeUpvalues(Value *last);
+
+// Drops whatever the frames above the handler's and the try itself left on
+// the stack, so the handler finds its locals where the compiler put them,
+// and leaves the exception back on top.
+static void unwindTo(CallFrame *frame, ExceptionHandler *handler) {
+  Value exception = peek(0);
+  vm.stackTop = frame->slots + handler->stackDepth;
+  closeUpvalues(vm.stackTop);
+  push(exception);
+}
+
 bool propagateException(void) {
-#define PLACEHOLDER_ADDRESS 0xffff
   // Grabs the exception from the top of the stack
   ObjInstance *exception = AS_INSTANCE(peek(0));
 
@@ -147,23 +213,30 @@ bool propagateException(void) {
       ExceptionHandler handler = frame->handlerStack[numHandlers - 1];
       // If the exception type matches...
       if (instanceof (exception, handler.cls)) {
+        unwindTo(frame, &handler);
         // point the ip to the handler's address within the current closure
-        frame->ip =
-            &frame->closure->function->chunk.code[handler.handlerAddress];
+        frame->ip = &frame->closure->function->decoded[handler.handlerAddress];
         return true;
-      } else if (handler.finallyAddress != PLACEHOLDER_ADDRESS) {
+      } else if (handler.finallyAddress != NO_ADDRESS) {
+        unwindTo(frame, &handler);
         // Signal to the "finally" block that we threw
         push(TRUE_VAL);
         // Set the "finally" address
-        frame->ip =
-            &frame->closure->function->chunk.code[handler.finallyAddress];
+        frame->ip = &frame->closure->function->decoded[handler.finallyAddress];
         return true;
       }
     }
     vm.frameCount--;
   }
   // Error unhandled - print and exit
-  fprintf(stderr, "Unhandled %s\n", exception->cls->name->chars);
+  Value message;
+  if (tableGet(&exception->fields, copyString("message", 7), &message) &&
+      IS_STRING(message)) {
+    fprintf(stderr, "Unhandled %s: %s\n", exception->cls->name->chars,
+            AS_CSTRING(message));
+  } else {
+    fprintf(stderr, "Unhandled %s\n", exception->cls->name->chars);
+  }
   // Grabs the stack trace value (a string) the exception's "stacktrace" field
   Value stacktrace;
   if (tableGet(&exception->fields, copyString("stacktrace", 10), &stacktrace)) {
@@ -172,11 +245,68 @@ bool propagateException(void) {
     fflush(stderr);
   }
   return false;
-#undef PLACEHOLDER_ADDRESS
 }
 
-void pushExceptionHandler(Value type, uint16_t handlerAddress,
-                          uint16_t finallyAddress) {
+// Throws the exception on top of the stack, the way a throw statement does.
+// Returns true if something caught it, in which case the frame that did is
+// on top and its ip points at the handler.
+static bool throwException(void) {
+  // Load the stack trace as a string Value
+  Value stacktrace = getStackTrace();
+  // The top value in the stack should be an Exception instance
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  // Set obj.stacktrace to the stack trace (again, a string Value)
+  ObjString *field = copyString("stacktrace", 10);
+  writeBarrierTable((Obj *)instance, &instance->fields, field, stacktrace);
+  tableSet(&instance->fields, field, stacktrace);
+  // Unwind the stack until a handler is found (or just unwind the whole
+  // thing and barf)
+  return propagateException();
+}
+
+// Leaves a message where a native's result goes, and returns false so the
+// native can hand it straight back. The VM throws it as an Exception.
+bool nativeError(Value *args, const char *format, ...) {
+  char buffer[256];
+  va_list list;
+  va_start(list, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, list);
+  va_end(list);
+  if (length >= (int)sizeof(buffer))
+    length = sizeof(buffer) - 1;
+  args[-1] = OBJ_VAL(copyString(buffer, length));
+  return false;
+}
+
+// Throws the error a native failed with, from the message it left in its
+// result slot, as if the call had been a throw statement. Without the
+// prelude's Exception class to throw, it's a plain runtime error instead.
+static bool throwNativeError(Value *result) {
+  vm.stackTop = result + 1;
+  Value cls;
+  if (!tableGet(&vm.globals, copyString("Exception", 9), &cls) ||
+      !IS_CLASS(cls)) {
+    runtimeError("%s", AS_CSTRING(*result));
+    return false;
+  }
+
+  ObjInstance *exception = newInstance(AS_CLASS(cls));
+  push(OBJ_VAL(exception));
+  ObjString *field = copyString("message", 7);
+  writeBarrierTable((Obj *)exception, &exception->fields, field, *result);
+  tableSet(&exception->fields, field, *result);
+  *result = pop();
+  return throwException();
+}
+
+// Whether the callee is a native that takes this many arguments, so it can
+// be called without any of the checks in callValue.
+static inline bool isDirectNative(Value callee, int argCount) {
+  return IS_NATIVE(callee) && AS_NATIVE(callee)->arity == argCount;
+}
+
+void pushExceptionHandler(Value type, uint32_t handlerAddress,
+                          uint32_t finallyAddress) {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
   if (frame->handlerCount == MAX_HANDLER_FRAMES) {
     runtimeError("Too many nested exception handlers in one function.");
@@ -184,26 +314,72 @@ void pushExceptionHandler(Value type, uint16_t handlerAddress,
   }
   frame->handlerStack[frame->handlerCount].handlerAddress = handlerAddress;
   frame->handlerStack[frame->handlerCount].finallyAddress = finallyAddress;
+  frame->handlerStack[frame->handlerCount].stackDepth =
+      (uint32_t)(vm.stackTop - frame->slots);
   frame->handlerStack[frame->handlerCount].cls = type;
   frame->handlerCount++;
 }
 
+// Runs a call to a function simple enough not to need a frame, by putting
+// what it returns where the callee was. Returns false if it isn't one, or if
+// this call would take it off the simple path - a field that isn't there, or
+// the wrong number of arguments - in which case it has to be called the usual
+// way, so any error comes from inside it.
+static bool callInline(ObjFunction *function, int argCount) {
+  if (function->inlineKind == INLINE_NONE || argCount != function->arity)
+    return false;
+
+  Value *slots = vm.stackTop - argCount - 1;
+  Value result;
+  switch (function->inlineKind) {
+  case INLINE_CONSTANT:
+    result = function->chunk.constants.values[function->inlineOperand];
+    break;
+  case INLINE_ARGUMENT:
+    result = slots[function->inlineOperand];
+    break;
+  case INLINE_FIELD: {
+    ObjString *name =
+        AS_STRING(function->chunk.constants.values[function->inlineOperand]);
+    if (!IS_INSTANCE(slots[0]) ||
+        !tableGet(&AS_INSTANCE(slots[0])->fields, name, &result)) {
+      return false;
+    }
+    break;
+  }
+  default:
+    return false;
+  }
+
+  slots[0] = result;
+  vm.stackTop = slots + 1;
+  return true;
+}
+
 static bool call(ObjClosure *closure, int argCount) {
+  if (callInline(closure->function, argCount))
+    return true;
+
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity,
                  argCount);
     return false;
   }
 
-  // Something to test with a recursive call...
-  if (vm.frameCount == FRAMES_MAX) {
+  // Something to test with a recursive call... Most functions fit in the
+  // stack's share for each frame, but one with more locals than that has to
+  // check there's room for them, and for some temporaries on top.
+  if (vm.frameCount == FRAMES_MAX ||
+      closure->function->slotCount > vm.stack + STACK_MAX - UINT8_COUNT -
+                                         (vm.stackTop - argCount - 1)) {
     runtimeError("Stack overflow.");
     return false;
   }
 
   CallFrame *frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
+  // Null until run() has decoded the function.
+  frame->ip = closure->function->decoded;
   // The arg count, plus `this`
   frame->slots = vm.stackTop - argCount - 1;
   return true;
@@ -233,10 +409,16 @@ static bool callValue(Value callee, int argCount) {
     case OBJ_CLOSURE:
       return call(AS_CLOSURE(callee), argCount);
     case OBJ_NATIVE: {
-      NativeFn native = AS_NATIVE(callee);
-      Value result = native(argCount, vm.stackTop - argCount);
-      vm.stackTop -= argCount + 1;
-      push(result);
+      ObjNative *native = AS_NATIVE(callee);
+      if (argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d.", native->arity,
+                     argCount);
+        return false;
+      }
+      Value *args = vm.stackTop - argCount;
+      if (!native->function(argCount, args))
+        return throwNativeError(args - 1);
+      vm.stackTop = args;
       return true;
     }
     default:
@@ -251,15 +433,17 @@ static bool invokeFromClass(ObjClass *cls, ObjString *name, int argCount) {
   Value method;
   if (!tableGet(&cls->methods, name, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
+    return false;
   }
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+static bool invoke(CallSite *site, ObjString *name, int argCount) {
   Value receiver = peek(argCount);
 
   if (!IS_INSTANCE(receiver)) {
     runtimeError("Only instances have methods.");
+    return false;
   }
 
   ObjInstance *instance = AS_INSTANCE(receiver);
@@ -269,7 +453,30 @@ static bool invoke(ObjString *name, int argCount) {
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
-  return invokeFromClass(instance->cls, name, argCount);
+
+  if (instance->cls == site->cls)
+    return call(site->method, argCount);
+  if (site->misses == MAX_SITE_MISSES)
+    return invokeFromClass(instance->cls, name, argCount);
+
+  Value method;
+  if (!tableGet(&instance->cls->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  // The site belongs to the function that's running.
+  Obj *owner = (Obj *)vm.frames[vm.frameCount - 1].closure->function;
+  if (site->cls != NULL) {
+    deletionBarrier(owner, OBJ_VAL(site->cls));
+    deletionBarrier(owner, OBJ_VAL(site->method));
+    site->misses++;
+  }
+  writeBarrier(owner, OBJ_VAL(instance->cls));
+  writeBarrier(owner, method);
+  site->cls = instance->cls;
+  site->method = AS_CLOSURE(method);
+  return call(site->method, argCount);
 }
 
 static bool bindMethod(ObjClass *cls, ObjString *name) {
@@ -321,6 +528,7 @@ static void closeUpvalues(Value *last) {
     // * "un-pointers" the upvalue's location into a copied value, which lets
     // us store that value on the upvalue itself
     upvalue->closed = *upvalue->location;
+    writeBarrier((Obj *)upvalue, upvalue->closed);
     // The location now points to the closed upvalue - this will apparently
     // be treated as lower than any stack-allocated pointer?
     upvalue->location = &upvalue->closed;
@@ -331,14 +539,11 @@ static void closeUpvalues(Value *last) {
 static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *cls = AS_CLASS(peek(1));
+  writeBarrierTable((Obj *)cls, &cls->methods, name, method);
   tableSet(&cls->methods, name, method);
   pop();
 }
 
-static bool isFalsey(Value value) {
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-}
-
 static void concatenate() {
   // We need to maintain the references to the string values until we have
   // the result, so they don't inadvertently get GC'd during the ALLOCATE.
@@ -358,356 +563,835 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
+// The parts of instructions that OP_WIDE can also prefix, shared by both
+// encodings. Each returns false on a runtime error.
+
+static bool getGlobal(ObjString *name) {
+  Value value;
+  if (!tableGet(&vm.globals, name, &value)) {
+    runtimeError("Undefined variable '%s'", name->chars);
+    return false;
+  }
+  push(value);
+  return true;
+}
+
+// Notes an assignment to a global, in case it's one an intrinsic stands in
+// for.
+static inline void checkRedefinition(ObjString *name) {
+  if (name->intrinsic != -1) {
+    vm.redefinedIntrinsics |= 1u << name->intrinsic;
+  }
+}
+
+static void defineGlobal(ObjString *name) {
+  checkRedefinition(name);
+  writeBarrierGlobals(name, peek(0));
+  tableSet(&vm.globals, name, peek(0));
+  pop();
+}
+
+static bool setGlobal(ObjString *name) {
+  checkRedefinition(name);
+  writeBarrierGlobals(name, peek(0));
+  if (tableSet(&vm.globals, name, peek(0))) {
+    // tableSet returned true, which means the variable wasn't
+    // previously defined - oops
+    tableDelete(&vm.globals, name);
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  return true;
+}
+
+// Calls whatever the global an intrinsic is named after holds, the way the
+// call would have gone if the compiler hadn't replaced it. The arguments are
+// already on the stack, so the callee goes in underneath them.
+static bool callIntrinsic(uint8_t instruction) {
+  const Intrinsic *intrinsic = &intrinsics[instruction - OP_ABS];
+  if (!getGlobal(copyString(intrinsic->name, intrinsic->length)))
+    return false;
+  int argCount = intrinsic->arity;
+  Value callee = peek(0);
+  Value *args = vm.stackTop - 1 - argCount;
+  memmove(args + 1, args, sizeof(Value) * argCount);
+  *args = callee;
+  return callValue(callee, argCount);
+}
+
+static bool getProperty(ObjString *name) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeError("Only instances have properties.");
+    return false;
+  }
+
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  Value value;
+  if (tableGet(&instance->fields, name, &value)) {
+    pop();       // Pop the instance we were operating on
+    push(value); // The value we just got
+    return true;
+  }
+
+  return bindMethod(instance->cls, name);
+}
+
+// Returns what's wrong with indexing the list with this value, or NULL if
+// it's the index of one of its elements.
+static const char *checkIndex(ObjList *list, Value index) {
+  if (!IS_NUMBER(index))
+    return "List index must be a number.";
+  double number = AS_NUMBER(index);
+  if (number != trunc(number))
+    return "List index must be a whole number.";
+  if (number < 0 || number >= list->items.count)
+    return "List index out of range.";
+  return NULL;
+}
+
+static bool setProperty(ObjString *name) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances have fields.");
+    return false;
+  }
+
+  ObjInstance *instance = AS_INSTANCE(peek(1));
+  writeBarrierTable((Obj *)instance, &instance->fields, name, peek(0));
+  tableSet(&instance->fields, name, peek(0));
+  Value value = pop();
+  pop();
+  push(value);
+  return true;
+}
+
+// Reads the captured variables that follow OP_CLOSURE's function in the
+// chunk, each a flag and an index of the given width.
+static void makeClosure(CallFrame *frame, ObjFunction *function, int width,
+                        const uint8_t *captures) {
+  // Wrap it in a closure
+  ObjClosure *closure = newClosure(function);
+  // Push it onto the symbol stack
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = *captures++;
+    uint16_t index = *captures++;
+    if (width == 2) {
+      index = (uint16_t)(index << 8) | *captures++;
+    }
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+}
+
+static bool catchType(ObjString *typeName, uint32_t handlerAddress,
+                      uint32_t finallyAddress) {
+  Value value;
+  if (!tableGet(&vm.globals, typeName, &value) || !IS_CLASS(value)) {
+    runtimeError("'%s' is not a type to catch", typeName->chars);
+    return false;
+  }
+  pushExceptionHandler(value, handlerAddress, finallyAddress);
+  return true;
+}
+
+// Whether a counted loop goes around again. It makes the same comparison the
+// loop's condition compiled to, so a NaN ends the loop or doesn't just as it
+// would have.
+static inline bool countedLoopContinues(double counter, double limit, int step,
+                                        uint8_t mode) {
+  if (mode & FOR_INCLUSIVE)
+    return step > 0 ? !(counter > limit) : !(counter < limit);
+  return step > 0 ? counter < limit : counter > limit;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame *frame, DecodedOp *ip) {
+  printf("          ");
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassembleInstruction(&frame->closure->function->chunk, (int)ip->offset);
+}
+#endif
+
+// Points a frame that's just been called at its function's code, decoding it
+// if this is the first time the function has run.
+static void startFrame(CallFrame *frame, const void *const *handlers) {
+  ObjFunction *function = frame->closure->function;
+  if (function->decoded == NULL)
+    decodeFunction(function, handlers);
+  frame->ip = function->decoded;
+}
+
 static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+  // Where the code for each opcode starts, for decoded instructions to go
+  // straight to. Opcodes that never survive decoding don't have any.
+#define HANDLER(opcode) [opcode] = &&do_##opcode
+  static const void *const handlers[OP_WIDE + 1] = {
+      HANDLER(OP_CONSTANT),
+      HANDLER(OP_POP),
+      HANDLER(OP_GET_LOCAL),
+      HANDLER(OP_SET_LOCAL),
+      HANDLER(OP_GET_GLOBAL),
+      HANDLER(OP_DEFINE_GLOBAL),
+      HANDLER(OP_SET_GLOBAL),
+      HANDLER(OP_GET_UPVALUE),
+      HANDLER(OP_SET_UPVALUE),
+      HANDLER(OP_GET_PROPERTY),
+      HANDLER(OP_SET_PROPERTY),
+      HANDLER(OP_GET_SUPER),
+      HANDLER(OP_BUILD_LIST),
+      HANDLER(OP_INDEX_GET),
+      HANDLER(OP_INDEX_SET),
+      HANDLER(OP_EQUAL),
+      HANDLER(OP_GREATER),
+      HANDLER(OP_LESS),
+      HANDLER(OP_ADD),
+      HANDLER(OP_SUBTRACT),
+      HANDLER(OP_MULTIPLY),
+      HANDLER(OP_DIVIDE),
+      HANDLER(OP_ADD_IMM),
+      HANDLER(OP_SUBTRACT_IMM),
+      HANDLER(OP_EQUAL_IMM),
+      HANDLER(OP_GREATER_IMM),
+      HANDLER(OP_LESS_IMM),
+      HANDLER(OP_ADD_RR),
+      HANDLER(OP_SUBTRACT_RR),
+      HANDLER(OP_MULTIPLY_RR),
+      HANDLER(OP_DIVIDE_RR),
+      HANDLER(OP_EQUAL_RR),
+      HANDLER(OP_GREATER_RR),
+      HANDLER(OP_LESS_RR),
+      HANDLER(OP_ADD_RI),
+      HANDLER(OP_SUBTRACT_RI),
+      HANDLER(OP_EQUAL_RI),
+      HANDLER(OP_GREATER_RI),
+      HANDLER(OP_LESS_RI),
+      HANDLER(OP_STORE_LOCAL),
+      HANDLER(OP_NOT),
+      HANDLER(OP_NEGATE),
+      HANDLER(OP_PRINT),
+      HANDLER(OP_JUMP),
+      HANDLER(OP_JUMP_IF_FALSE),
+      HANDLER(OP_FOR_PREP),
+      HANDLER(OP_FOR_LOOP),
+      HANDLER(OP_CALL),
+      HANDLER(OP_CALL_NATIVE),
+      HANDLER(OP_ABS),
+      HANDLER(OP_FLOOR),
+      HANDLER(OP_CEIL),
+      HANDLER(OP_SQRT),
+      HANDLER(OP_SIN),
+      HANDLER(OP_COS),
+      HANDLER(OP_POW),
+      HANDLER(OP_MIN),
+      HANDLER(OP_MAX),
+      HANDLER(OP_INVOKE),
+      HANDLER(OP_SUPER_INVOKE),
+      HANDLER(OP_CLOSURE),
+      HANDLER(OP_CLOSE_UPVALUE),
+      HANDLER(OP_RETURN),
+      HANDLER(OP_CLASS),
+      HANDLER(OP_INHERIT),
+      HANDLER(OP_METHOD),
+      HANDLER(OP_THROW),
+      HANDLER(OP_PUSH_EXCEPTION_HANDLER),
+      HANDLER(OP_POP_EXCEPTION_HANDLER),
+      HANDLER(OP_PROPAGATE_EXCEPTION),
+  };
+#undef HANDLER
+
+  // The frame's ip lives in a local while it runs, and only gets written
+  // back before anything that looks at it - calls, errors and exceptions.
+  CallFrame *frame;
+  DecodedOp *ip;
+  // The instruction that's running.
+  DecodedOp *op;
+  // The intrinsic that's calling its global instead.
+  uint8_t intrinsic;
+#define TARGET(opcode) do_##opcode:
+#define READ_STRING() AS_STRING(op->value)
+#ifdef COUNT_DISPATCHES
+#define COUNT_DISPATCH() vm.dispatchCount++
+#else
+#define COUNT_DISPATCH()
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() traceExecution(frame, ip)
+#else
+#define TRACE_EXECUTION()
+#endif
+  // Collections only happen here, between instructions, where every live
+  // object is reachable from the VM's roots.
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (vm.gcRequested && !gcSafepoint()) {                                    \
+      RUNTIME_ERROR("Out of memory.");                                         \
+    }                                                                          \
+    COUNT_DISPATCH();                                                          \
+    TRACE_EXECUTION();                                                         \
+    op = ip++;                                                                 \
+    goto *op->handler;                                                         \
+  } while (false)
+#define SAVE_IP() (frame->ip = ip)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SAVE_IP();                                                                 \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+  // Picks up the frame on top of the stack after a call.
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    if (frame->ip == NULL)                                                     \
+      startFrame(frame, handlers);                                             \
+    ip = frame->ip;                                                            \
+  } while (false)
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
     }                                                                          \
     double b = AS_NUMBER(pop());                                               \
     double a = AS_NUMBER(pop());                                               \
     push(valueType(a op b));                                                   \
   } while (false)
+// A binary operator whose right operand is a signed byte in the code.
+#define IMMEDIATE_OP(valueType, operator)                                      \
+  do {                                                                         \
+    if (!IS_NUMBER(peek(0))) {                                                 \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    vm.stackTop[-1] = valueType(AS_NUMBER(peek(0)) operator op->a);            \
+  } while (false)
+// A binary operator on two locals, named by their slots.
+#define REGISTER_OP(valueType, operator)                                       \
+  do {                                                                         \
+    Value a = frame->slots[op->a];                                             \
+    Value b = frame->slots[op->b];                                             \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    push(valueType(AS_NUMBER(a) operator AS_NUMBER(b)));                       \
+  } while (false)
+// A binary operator on a local and a signed byte in the code.
+#define REGISTER_IMMEDIATE_OP(valueType, operator)                             \
+  do {                                                                         \
+    Value a = frame->slots[op->a];                                             \
+    if (!IS_NUMBER(a)) {                                                       \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    push(valueType(AS_NUMBER(a) operator op->b));                              \
+  } while (false)
 #ifdef DEBUG_TRACE_EXECUTION
   printf("-- trace --\n");
 #endif
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      push(constant);
-      break;
+  LOAD_FRAME();
+  DISPATCH();
+
+  TARGET(OP_CONSTANT) {
+    push(op->value);
+    DISPATCH();
+  }
+  TARGET(OP_POP) {
+    pop();
+    DISPATCH();
+  }
+  TARGET(OP_GET_LOCAL) {
+    push(frame->slots[op->a]);
+    DISPATCH();
+  }
+  TARGET(OP_SET_LOCAL) {
+    frame->slots[op->a] = peek(0);
+    DISPATCH();
+  }
+  TARGET(OP_GET_GLOBAL) {
+    SAVE_IP();
+    if (!getGlobal(READ_STRING())) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
-    case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+    DISPATCH();
+  }
+  TARGET(OP_DEFINE_GLOBAL) {
+    defineGlobal(READ_STRING());
+    DISPATCH();
+  }
+  TARGET(OP_SET_GLOBAL) {
+    SAVE_IP();
+    if (!setGlobal(READ_STRING())) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_SET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+    DISPATCH();
+  }
+  TARGET(OP_GET_UPVALUE) {
+    push(*frame->closure->upvalues[op->a]->location);
+    DISPATCH();
+  }
+  TARGET(OP_SET_UPVALUE) {
+    ObjUpvalue *upvalue = frame->closure->upvalues[op->a];
+    deletionBarrier((Obj *)upvalue, *upvalue->location);
+    *upvalue->location = peek(0);
+    writeBarrier((Obj *)upvalue, peek(0));
+    DISPATCH();
+  }
+  TARGET(OP_GET_PROPERTY) {
+    SAVE_IP();
+    if (!getProperty(READ_STRING())) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
-      break;
+    DISPATCH();
+  }
+  TARGET(OP_SET_PROPERTY) {
+    SAVE_IP();
+    if (!setProperty(READ_STRING())) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
+    DISPATCH();
+  }
+  TARGET(OP_GET_SUPER) {
+    ObjString *name = READ_STRING();
+    ObjClass *superclass = AS_CLASS(pop());
+
+    SAVE_IP();
+    if (!bindMethod(superclass, name)) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        // tableSet returned true, which means the variable wasn't
-        // previously defined - oops
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
+    DISPATCH();
+  }
+  TARGET(OP_BUILD_LIST) {
+    ObjList *list = newList();
+    Value *items = vm.stackTop - op->a;
+    for (int i = 0; i < op->a; i++) {
+      appendToList(list, items[i]);
     }
-    case OP_GET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+    vm.stackTop = items;
+    push(OBJ_VAL(list));
+    DISPATCH();
+  }
+  TARGET(OP_INDEX_GET) {
+    if (!IS_LIST(peek(1))) {
+      RUNTIME_ERROR("Only lists can be indexed.");
     }
-    case OP_SET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+    ObjList *list = AS_LIST(peek(1));
+    const char *error = checkIndex(list, peek(0));
+    if (error != NULL) {
+      RUNTIME_ERROR("%s", error);
     }
-    case OP_GET_PROPERTY: {
-      if (!IS_INSTANCE(peek(0))) {
-        runtimeError("Only instances have properties.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      ObjInstance *instance = AS_INSTANCE(peek(0));
-      ObjString *name = READ_STRING();
-
-      Value value;
-      if (tableGet(&instance->fields, name, &value)) {
-        pop();       // Pop the instance we were operating on
-        push(value); // The value we just got
-        break;
-      }
-
-      if (!bindMethod(instance->cls, name)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
+    Value item = list->items.values[(int)AS_NUMBER(peek(0))];
+    vm.stackTop--;
+    vm.stackTop[-1] = item;
+    DISPATCH();
+  }
+  TARGET(OP_INDEX_SET) {
+    if (!IS_LIST(peek(2))) {
+      RUNTIME_ERROR("Only lists can be indexed.");
     }
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(peek(1))) {
-        runtimeError("Only instances have fields.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      ObjInstance *instance = AS_INSTANCE(peek(1));
-      tableSet(&instance->fields, READ_STRING(), peek(0));
-      Value value = pop();
-      pop();
-      push(value);
-      break;
+    ObjList *list = AS_LIST(peek(2));
+    const char *error = checkIndex(list, peek(1));
+    if (error != NULL) {
+      RUNTIME_ERROR("%s", error);
     }
-    case OP_GET_SUPER: {
-      ObjString *name = READ_STRING();
-      ObjClass *superclass = AS_CLASS(pop());
-
-      if (!bindMethod(superclass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
+    Value *slot = &list->items.values[(int)AS_NUMBER(peek(1))];
+    Value value = peek(0);
+    deletionBarrier((Obj *)list, *slot);
+    *slot = value;
+    writeBarrier((Obj *)list, value);
+    // Assignment is an expression, so the value stays
+    vm.stackTop -= 2;
+    vm.stackTop[-1] = value;
+    DISPATCH();
+  }
+  TARGET(OP_EQUAL) {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+    DISPATCH();
+  }
+  TARGET(OP_GREATER) {
+    BINARY_OP(BOOL_VAL, >);
+    DISPATCH();
+  }
+  TARGET(OP_LESS) {
+    BINARY_OP(BOOL_VAL, <);
+    DISPATCH();
+  }
+  TARGET(OP_ADD) {
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+      concatenate();
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+      double b = AS_NUMBER(pop());
+      double a = AS_NUMBER(pop());
+      push(NUMBER_VAL(a + b));
+    } else {
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
+    DISPATCH();
+  }
+  TARGET(OP_SUBTRACT) {
+    BINARY_OP(NUMBER_VAL, -);
+    DISPATCH();
+  }
+  TARGET(OP_MULTIPLY) {
+    BINARY_OP(NUMBER_VAL, *);
+    DISPATCH();
+  }
+  TARGET(OP_DIVIDE) {
+    BINARY_OP(NUMBER_VAL, /);
+    DISPATCH();
+  }
+  TARGET(OP_ADD_IMM) {
+    if (!IS_NUMBER(peek(0))) {
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");
     }
-    case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-        concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
-      } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    };
-    case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_PRINT:
-      printValue(pop());
-      printf("\n");
-      break;
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+    vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) + op->a);
+    DISPATCH();
+  }
+  TARGET(OP_SUBTRACT_IMM) {
+    IMMEDIATE_OP(NUMBER_VAL, -);
+    DISPATCH();
+  }
+  TARGET(OP_EQUAL_IMM) {
+    vm.stackTop[-1] =
+        BOOL_VAL(IS_NUMBER(peek(0)) && AS_NUMBER(peek(0)) == op->a);
+    DISPATCH();
+  }
+  TARGET(OP_GREATER_IMM) {
+    IMMEDIATE_OP(BOOL_VAL, >);
+    DISPATCH();
+  }
+  TARGET(OP_LESS_IMM) {
+    IMMEDIATE_OP(BOOL_VAL, <);
+    DISPATCH();
+  }
+  TARGET(OP_ADD_RR) {
+    Value a = frame->slots[op->a];
+    Value b = frame->slots[op->b];
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+      push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+    } else if (IS_STRING(a) && IS_STRING(b)) {
+      push(a);
+      push(b);
+      concatenate();
+    } else {
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");
     }
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0)))
-        frame->ip += offset;
-      break;
+    DISPATCH();
+  }
+  TARGET(OP_SUBTRACT_RR) {
+    REGISTER_OP(NUMBER_VAL, -);
+    DISPATCH();
+  }
+  TARGET(OP_MULTIPLY_RR) {
+    REGISTER_OP(NUMBER_VAL, *);
+    DISPATCH();
+  }
+  TARGET(OP_DIVIDE_RR) {
+    REGISTER_OP(NUMBER_VAL, /);
+    DISPATCH();
+  }
+  TARGET(OP_EQUAL_RR) {
+    push(BOOL_VAL(valuesEqual(frame->slots[op->a], frame->slots[op->b])));
+    DISPATCH();
+  }
+  TARGET(OP_GREATER_RR) {
+    REGISTER_OP(BOOL_VAL, >);
+    DISPATCH();
+  }
+  TARGET(OP_LESS_RR) {
+    REGISTER_OP(BOOL_VAL, <);
+    DISPATCH();
+  }
+  TARGET(OP_ADD_RI) {
+    Value a = frame->slots[op->a];
+    if (!IS_NUMBER(a)) {
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");
     }
-    case OP_LOOP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+    push(NUMBER_VAL(AS_NUMBER(a) + op->b));
+    DISPATCH();
+  }
+  TARGET(OP_SUBTRACT_RI) {
+    REGISTER_IMMEDIATE_OP(NUMBER_VAL, -);
+    DISPATCH();
+  }
+  TARGET(OP_EQUAL_RI) {
+    Value a = frame->slots[op->a];
+    push(BOOL_VAL(IS_NUMBER(a) && AS_NUMBER(a) == op->b));
+    DISPATCH();
+  }
+  TARGET(OP_GREATER_RI) {
+    REGISTER_IMMEDIATE_OP(BOOL_VAL, >);
+    DISPATCH();
+  }
+  TARGET(OP_LESS_RI) {
+    REGISTER_IMMEDIATE_OP(BOOL_VAL, <);
+    DISPATCH();
+  }
+  TARGET(OP_STORE_LOCAL) {
+    frame->slots[op->a] = pop();
+    DISPATCH();
+  }
+  TARGET(OP_NOT) {
+    push(BOOL_VAL(isFalsey(pop())));
+    DISPATCH();
+  }
+  TARGET(OP_NEGATE) {
+    if (!IS_NUMBER(peek(0))) {
+      RUNTIME_ERROR("Operand must be a number.");
     }
-    case OP_CALL: {
-      int argCount = READ_BYTE();
-      if (!callValue(peek(argCount), argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      // Set the current frame to the one we just allocated
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+    push(NUMBER_VAL(-AS_NUMBER(pop())));
+    DISPATCH();
+  }
+  TARGET(OP_PRINT) {
+    printValue(pop());
+    printf("\n");
+    DISPATCH();
+  }
+  TARGET(OP_JUMP) {
+    // Forwards or backwards - OP_LOOP decodes to this too.
+    ip = op->target;
+    DISPATCH();
+  }
+  TARGET(OP_JUMP_IF_FALSE) {
+    if (isFalsey(peek(0)))
+      ip = op->target;
+    DISPATCH();
+  }
+  TARGET(OP_FOR_PREP) {
+    Value counter = frame->slots[op->a];
+    Value limit = op->flags & FOR_LOCAL_LIMIT ? frame->slots[op->c] : op->value;
+    if (!IS_NUMBER(counter) || !IS_NUMBER(limit)) {
+      RUNTIME_ERROR("Operands must be numbers.");
     }
-    case OP_INVOKE: {
-      ObjString *method = READ_STRING();
-      int argCount = READ_BYTE();
-      if (!invoke(method, argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+    if (!countedLoopContinues(AS_NUMBER(counter), AS_NUMBER(limit), op->b,
+                              op->flags))
+      ip = op->target;
+    DISPATCH();
+  }
+  TARGET(OP_FOR_LOOP) {
+    // The same errors the increment and the condition would have given.
+    Value *counter = &frame->slots[op->a];
+    if (!IS_NUMBER(*counter)) {
+      RUNTIME_ERROR(op->b > 0 ? "Operands must be two numbers or two strings."
+                              : "Operands must be numbers.");
     }
-    case OP_SUPER_INVOKE: {
-      ObjString *method = READ_STRING();
-      int argCount = READ_BYTE();
-      ObjClass *superclass = AS_CLASS(pop());
-      if (!invokeFromClass(superclass, method, argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+    double next = AS_NUMBER(*counter) + op->b;
+    *counter = NUMBER_VAL(next);
+    Value limit = op->flags & FOR_LOCAL_LIMIT ? frame->slots[op->c] : op->value;
+    if (!IS_NUMBER(limit)) {
+      RUNTIME_ERROR("Operands must be numbers.");
     }
-    case OP_CLOSURE: {
-      // Read the function from the constants table
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-      // Wrap it in a closure
-      ObjClosure *closure = newClosure(function);
-      // Push it onto the symbol stack
-      push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalueCount; i++) {
-        uint8_t isLocal = READ_BYTE();
-        uint8_t index = READ_BYTE();
-        if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
-        } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
-        }
-      }
-      break;
+    if (countedLoopContinues(next, AS_NUMBER(limit), op->b, op->flags))
+      ip = op->target;
+    DISPATCH();
+  }
+  TARGET(OP_CALL) {
+    int argCount = op->a;
+    // A call that finds a native turns into one that only calls natives.
+    if (isDirectNative(peek(argCount), argCount)) {
+      op->handler = handlers[OP_CALL_NATIVE];
+      goto do_OP_CALL_NATIVE;
     }
-    case OP_CLOSE_UPVALUE:
-      closeUpvalues(vm.stackTop - 1);
-      pop();
-      break;
-    case OP_RETURN: {
-      // Return value is at the top of the stack
-      Value result = pop();
-      // We don't actually emit an OP_CLOSE_UPVALUE before a function returns,
-      // just at the end of a block, so we do it here. We do this instead of
-      // explicitly emitting the instructions because we already discard the
-      // slots when we throw out the old frame a few lines from here.
-      closeUpvalues(frame->slots);
-      // Chuck the prior frame
-      vm.frameCount--;
-      if (vm.frameCount == 0) {
-        // Pop the main function
-        pop();
-        // Exit interpreter.
-        return INTERPRET_OK;
-      }
-
-      // Throw the old frame out of the stack
-      vm.stackTop = frame->slots;
-      // Put the result back on the stack
-      push(result);
-      // Now pointing to our original frame
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+    SAVE_IP();
+    if (!callValue(peek(argCount), argCount)) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_CLASS:
-      push(OBJ_VAL(newClass(READ_STRING())));
-      break;
-    case OP_INHERIT: {
-      Value superclass = peek(1);
-      if (!IS_CLASS(superclass)) {
-        runtimeError("Superclass must be a class.");
+    // Set the current frame to the one we just allocated
+    LOAD_FRAME();
+    DISPATCH();
+  }
+  TARGET(OP_CALL_NATIVE) {
+    int argCount = op->a;
+    // Anything else goes back through the usual call
+    if (!isDirectNative(peek(argCount), argCount))
+      goto do_OP_CALL;
+    Value *args = vm.stackTop - argCount;
+    if (!AS_NATIVE(peek(argCount))->function(argCount, args)) {
+      SAVE_IP();
+      if (!throwNativeError(args - 1)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-
-      ObjClass *subclass = AS_CLASS(peek(0));
-      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-      pop(); // Subclass.
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_METHOD:
-      defineMethod(READ_STRING());
-      break;
-    case OP_THROW: {
-      // Load the stack trace as a string Value
-      Value stacktrace = getStackTrace();
-      // The top value in the stack should be an Exception instance
-      ObjInstance *instance = AS_INSTANCE(peek(0));
-      // Set obj.stacktrace to the stack trace (again, a string Value)
-      tableSet(&instance->fields, copyString("stacktrace", 10), stacktrace);
-      // Unwind the stack until a handler is found (or just unwind the whole
-      // thing and barf)
-      if (propagateException()) {
-        // If the exception was handled, we can drop any frames we threw out
-        // while propagating the exception.
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      // If the exception isn't handled, it's a runtime error
+    vm.stackTop = args;
+    DISPATCH();
+  }
+  // The intrinsics. An intrinsic whose global has been assigned to, or that
+  // was given something other than numbers, makes the call it replaced
+  // instead, so anything else - including errors - works out the same.
+#define INTRINSIC_INTACT(opcode)                                               \
+  (!(vm.redefinedIntrinsics & (1u << (opcode - OP_ABS))))
+#define UNARY_INTRINSIC(opcode, function)                                      \
+  TARGET(opcode) {                                                             \
+    if (INTRINSIC_INTACT(opcode) && IS_NUMBER(peek(0))) {                      \
+      vm.stackTop[-1] = NUMBER_VAL(function(AS_NUMBER(peek(0))));              \
+      DISPATCH();                                                              \
+    }                                                                          \
+    intrinsic = opcode;                                                        \
+    goto intrinsicFallback;                                                    \
+  }
+#define BINARY_INTRINSIC(opcode, expression)                                   \
+  TARGET(opcode) {                                                             \
+    if (INTRINSIC_INTACT(opcode) && IS_NUMBER(peek(0)) &&                      \
+        IS_NUMBER(peek(1))) {                                                  \
+      double b = AS_NUMBER(pop());                                             \
+      double a = AS_NUMBER(peek(0));                                           \
+      vm.stackTop[-1] = NUMBER_VAL(expression);                                \
+      DISPATCH();                                                              \
+    }                                                                          \
+    intrinsic = opcode;                                                        \
+    goto intrinsicFallback;                                                    \
+  }
+  UNARY_INTRINSIC(OP_ABS, fabs)
+  UNARY_INTRINSIC(OP_FLOOR, floor)
+  UNARY_INTRINSIC(OP_CEIL, ceil)
+  UNARY_INTRINSIC(OP_SQRT, sqrt)
+  UNARY_INTRINSIC(OP_SIN, sin)
+  UNARY_INTRINSIC(OP_COS, cos)
+  BINARY_INTRINSIC(OP_POW, pow(a, b))
+  // The same way round as the natives, for NaNs' sake.
+  BINARY_INTRINSIC(OP_MIN, b < a ? b : a)
+  BINARY_INTRINSIC(OP_MAX, b > a ? b : a)
+#undef UNARY_INTRINSIC
+#undef BINARY_INTRINSIC
+#undef INTRINSIC_INTACT
+  intrinsicFallback : {
+    SAVE_IP();
+    if (!callIntrinsic(intrinsic)) {
       return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_PUSH_EXCEPTION_HANDLER: {
-      ObjString *typeName = READ_STRING();
-      uint16_t handlerAddress = READ_SHORT();
-      uint16_t finallyAddress = READ_SHORT();
-      Value value;
-      if (!tableGet(&vm.globals, typeName, &value) || !IS_CLASS(value)) {
-        runtimeError("'%s' is not a type to catch", typeName->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      printf("after\n");
-      pushExceptionHandler(value, handlerAddress, finallyAddress);
-      break;
+    LOAD_FRAME();
+    DISPATCH();
+  }
+  TARGET(OP_INVOKE) {
+    CallSite *site = &frame->closure->function->callSites[op->b];
+    SAVE_IP();
+    if (!invoke(site, READ_STRING(), op->a)) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_POP_EXCEPTION_HANDLER: {
-      frame->handlerCount--;
-      break;
+    LOAD_FRAME();
+    DISPATCH();
+  }
+  TARGET(OP_SUPER_INVOKE) {
+    ObjClass *superclass = AS_CLASS(pop());
+    SAVE_IP();
+    if (!invokeFromClass(superclass, READ_STRING(), op->a)) {
+      return INTERPRET_RUNTIME_ERROR;
     }
-    case OP_PROPAGATE_EXCEPTION: {
-      frame->handlerCount--;
-      if (propagateException()) {
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
+    LOAD_FRAME();
+    DISPATCH();
+  }
+  TARGET(OP_CLOSURE) {
+    makeClosure(frame, AS_FUNCTION(op->value), op->a,
+                frame->closure->function->chunk.code + op->b);
+    DISPATCH();
+  }
+  TARGET(OP_CLOSE_UPVALUE) {
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+    DISPATCH();
+  }
+  TARGET(OP_RETURN) {
+    // Return value is at the top of the stack
+    Value result = pop();
+    // We don't actually emit an OP_CLOSE_UPVALUE before a function returns,
+    // just at the end of a block, so we do it here. We do this instead of
+    // explicitly emitting the instructions because we already discard the
+    // slots when we throw out the old frame a few lines from here.
+    closeUpvalues(frame->slots);
+    // Chuck the prior frame
+    vm.frameCount--;
+    if (vm.frameCount == 0) {
+      // Pop the main function
+      pop();
+      // Exit interpreter.
+      return INTERPRET_OK;
+    }
+
+    // Throw the old frame out of the stack
+    vm.stackTop = frame->slots;
+    // Put the result back on the stack
+    push(result);
+    // Now pointing to our original frame
+    frame = &vm.frames[vm.frameCount - 1];
+    ip = frame->ip;
+    DISPATCH();
+  }
+  TARGET(OP_CLASS) {
+    push(OBJ_VAL(newClass(READ_STRING())));
+    DISPATCH();
+  }
+  TARGET(OP_INHERIT) {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+      RUNTIME_ERROR("Superclass must be a class.");
+    }
+
+    ObjClass *subclass = AS_CLASS(peek(0));
+    // Could copy any number of young methods, so skip the barrier checks
+    // The subclass is brand new, so nothing in it gets overwritten here
+    rememberObject((Obj *)subclass);
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    pop(); // Subclass.
+    DISPATCH();
+  }
+  TARGET(OP_METHOD) {
+    defineMethod(READ_STRING());
+    DISPATCH();
+  }
+  TARGET(OP_THROW) {
+    SAVE_IP();
+    if (throwException()) {
+      // If the exception was handled, we can drop any frames we threw out
+      // while propagating the exception.
+      frame = &vm.frames[vm.frameCount - 1];
+      ip = frame->ip;
+      DISPATCH();
+    }
+    // If the exception isn't handled, it's a runtime error
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  TARGET(OP_PUSH_EXCEPTION_HANDLER) {
+    uint32_t finallyAddress = op->b < 0 ? NO_ADDRESS : (uint32_t)op->b;
+    SAVE_IP();
+    if (!catchType(READ_STRING(), (uint32_t)op->a, finallyAddress)) {
       return INTERPRET_RUNTIME_ERROR;
     }
+    DISPATCH();
+  }
+  TARGET(OP_POP_EXCEPTION_HANDLER) {
+    frame->handlerCount--;
+    DISPATCH();
+  }
+  TARGET(OP_PROPAGATE_EXCEPTION) {
+    frame->handlerCount--;
+    SAVE_IP();
+    if (propagateException()) {
+      frame = &vm.frames[vm.frameCount - 1];
+      ip = frame->ip;
+      DISPATCH();
     }
+    return INTERPRET_RUNTIME_ERROR;
   }
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef READ_SHORT
+#undef TARGET
 #undef READ_STRING
+#undef COUNT_DISPATCH
+#undef TRACE_EXECUTION
+#undef DISPATCH
+#undef SAVE_IP
+#undef RUNTIME_ERROR
+#undef LOAD_FRAME
 #undef BINARY_OP
+#undef IMMEDIATE_OP
+#undef REGISTER_OP
+#undef REGISTER_IMMEDIATE_OP
 }
 
 InterpretResult interpret(const char *source) {
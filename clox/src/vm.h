@@ -2,6 +2,8 @@
 #define clox_vm_h
 
 #include "object.h"
+#include "page.h"
+#include "pool.h"
 #include "table.h"
 #include "value.h"
 
@@ -9,20 +11,73 @@
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 #define MAX_HANDLER_FRAMES 16
 
+// The finally address of a handler that doesn't have one.
+#define NO_ADDRESS UINT32_MAX
+
+// The addresses are indexes into the function's decoded code.
 typedef struct {
-  uint16_t handlerAddress;
-  uint16_t finallyAddress;
+  uint32_t handlerAddress;
+  uint32_t finallyAddress;
+  // How many values the frame had on the stack when the try began, which is
+  // what it goes back to when the handler catches something.
+  uint32_t stackDepth;
   Value cls;
 } ExceptionHandler;
 
 typedef struct {
   ObjClosure *closure;
-  uint8_t *ip;
+  // The next instruction to run, in the function's decoded code.
+  struct DecodedOp *ip;
   Value *slots;
   uint8_t handlerCount;
   ExceptionHandler handlerStack[MAX_HANDLER_FRAMES];
 } CallFrame;
 
+// Where the old generation's collector is in its cycle. Marking and
+// sweeping are spread across many safepoints, a step at a time.
+typedef enum { GC_IDLE, GC_MARKING, GC_SWEEPING } GCPhase;
+
+// Tuning for the garbage collector, from the command line or the
+// environment. Zero means the default.
+typedef struct {
+  // The most the heap may grow by after a cycle before the next one starts.
+  double growFactor;
+  // How big the heap gets before the first cycle.
+  size_t initialHeap;
+  // The fraction of its time the program should spend paused for the
+  // collector. The pacer spaces cycles out to match.
+  double cpuFraction;
+  // The pacer collects more often as the heap gets close to this.
+  size_t softLimit;
+  // Past this, the program fails with an out of memory error.
+  size_t heapLimit;
+} GCConfig;
+
+// Pauses are bucketed by order of magnitude, from under a microsecond up to
+// a second or more.
+#define GC_PAUSE_BUCKETS 8
+
+// What the collector has been up to, for gcStats() and --gc-stats.
+typedef struct {
+  int minorCollections;
+  int cycles;
+  int fullCollections;
+  // Objects freed, young or old.
+  size_t bytesFreed;
+  size_t bytesPromoted;
+  double totalPause;
+  // The longest a single safepoint has spent collecting, in seconds.
+  double maxPause;
+  int pauseHistogram[GC_PAUSE_BUCKETS];
+} GCStats;
+
+// A buffer whose free has been put off until marking is done. Pooled
+// buffers need their size to find their way back to the right free list.
+typedef struct {
+  void *pointer;
+  size_t size;
+} DeferredFree;
+
 typedef struct {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
@@ -34,15 +89,76 @@ typedef struct {
   Table strings;
   ObjString *initString;
   ObjUpvalue *openUpvalues;
+  // A bit for each intrinsic whose global the program has assigned to, so
+  // its instruction can't trust that it still holds the native.
+  uint32_t redefinedIntrinsics;
 
+  // The old generation, in pages sorted by size class. bytesAllocated only
+  // counts memory outside the nursery - old objects and the buffers that any
+  // object points to.
+  SizeClass sizeClasses[SIZE_CLASS_COUNT];
+  // Small buffers come out of here rather than malloc.
+  BufferPool buffers;
   size_t bytesAllocated;
   size_t nextGC;
-  Obj *objects;
+  // Bumped every time marking finishes, leaving every page to be swept.
+  uint32_t sweepEpoch;
+
+  // The young generation is a single bump-allocated region.
+  uint8_t *nurseryStart;
+  uint8_t *nurseryTop;
+  uint8_t *nurseryEnd;
+
+  // Collections only run at safepoints, since a minor collection moves
+  // objects out from under any pointers the C code is holding. Allocation
+  // just raises this flag.
+  bool gcRequested;
+  // Set when the program asks for a full collection at the next safepoint.
+  bool collectRequested;
+  // Set once the nursery runs out of room, so the next safepoint knows to
+  // empty it.
+  bool nurseryFull;
+
+  // Old objects that may point into the nursery, maintained by the write
+  // barrier.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
+  bool globalsRemembered;
+
+  // Objects promoted by the current minor collection that still need their
+  // references forwarded.
+  int promotedCount;
+  int promotedCapacity;
+  Obj **promotedStack;
 
   // A stack of gray values, for garbage collection purposes.
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+
+  // Old objects that were about to be overwritten while marking, logged by
+  // the write barrier and handed to the marker at the next safepoint.
+  int satbCount;
+  int satbCapacity;
+  Obj **satbLog;
+
+  // Memory the program freed during marking. The marker may still be
+  // reading it, so it isn't really freed until marking is done.
+  int deferredCount;
+  int deferredCapacity;
+  DeferredFree *deferredFrees;
+
+  // The collector's state. Marking happens on its own threads when it can,
+  // and sweeping lazily, a page at a time.
+  GCPhase gcPhase;
+  GCConfig gcConfig;
+  GCStats gcStats;
+
+#ifdef COUNT_DISPATCHES
+  // How many instructions have been run, for comparing instruction sets.
+  uint64_t dispatchCount;
+#endif
 } VM;
 
 typedef enum {
@@ -58,5 +174,7 @@ void freeVM();
 InterpretResult interpret(const char *source);
 void push(Value value);
 Value pop();
+void defineNative(const char *name, NativeFn function, int arity);
+bool nativeError(Value *args, const char *format, ...);
 
 #endif